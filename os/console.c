@@ -19,6 +19,7 @@ volatile int panicked = 0;
 
 struct {
     spinlock_t lock;
+    struct wait_queue wq;  // readers waiting for input
 
     // input
 #define INPUT_BUF_SIZE 128
@@ -88,6 +89,7 @@ void console_init() {
     assert(!uart_inited);
     spinlock_init(&uart_tx_lock, "uart_tx");
     spinlock_init(&cons.lock, "cons");
+    init_waitqueue(&cons.wq, "cons");
 
     // no need to init uart8250, they are already inited by OpenSBI.
 
@@ -119,6 +121,9 @@ static void consintr(int c) {
         case C('Q'):
             print_kpgmgr();
             break;
+        case C('R'):
+            print_sched();
+            break;
         case C('U'):  // Kill line.
             while (cons.e != cons.w && cons.buf[(cons.e - 1) % INPUT_BUF_SIZE] != '\n') {
                 cons.e--;
@@ -145,7 +150,7 @@ static void consintr(int c) {
                     // wake up consoleread() if a whole line (or end-of-file)
                     // has arrived.
                     cons.w = cons.e;
-                    wakeup(&cons);
+                    wake_up(&cons.wq);
                 }
             }
             break;
@@ -167,47 +172,49 @@ void uart_intr() {
 int64 user_console_write(uint64 __user buf, int64 len) {
     if (len <= 0)
         return -EINVAL;
-    len = MIN(len, KSTRING_MAX);
 
     int ret;
     struct proc *p = curr_proc();
     struct mm *mm;
 
-    // Assignment 3 CoW: we replace this with a kstrbuf.
-    // to avoid lots of kallocpage/kfreepage log in console.
-    char *kbuf = kalloc(&kstrbuf);
+    // the buffer is sized to the write, up to a page. Longer writes go in page-sized chunks.
+    int64 bufsz = MIN(len, PGSIZE);
+    char *kbuf  = kmalloc(bufsz);
     if (kbuf == NULL) {
         return -ENOMEM;
     }
 
     acquire(&p->lock);
     mm = p->mm;
-    acquire(&mm->lock);
     release(&p->lock);
 
-    if ((ret = copy_from_user(mm, kbuf, buf, len)) < 0) {
+    for (int64 off = 0; off < len; off += bufsz) {
+        int64 n = MIN(len - off, bufsz);
+
+        acquire(&mm->lock);
+        ret = copy_from_user(mm, kbuf, buf + off, n);
         release(&mm->lock);
-        goto err;
-    }
-    release(&mm->lock);
+        if (ret < 0)
+            goto err;
 
-    // do not interfere with kernel panic's print.
-    acquire_kprint();
-    // do not interfere with other user's print.
-    acquire(&uart_tx_lock);
+        // do not interfere with kernel panic's print.
+        acquire_kprint();
+        // do not interfere with other user's print.
+        acquire(&uart_tx_lock);
 
-    for (int64 i = 0; i < len; i++) {
-        consputc(kbuf[i]);
-    }
+        for (int64 i = 0; i < n; i++) {
+            consputc(kbuf[i]);
+        }
 
-    release(&uart_tx_lock);
-    release_kprint();
+        release(&uart_tx_lock);
+        release_kprint();
+    }
 
-    kfree(&kstrbuf, kbuf);
+    kfree_sized(kbuf, bufsz);
     return len;
 
 err:
-    kfree(&kstrbuf, kbuf);
+    kfree_sized(kbuf, bufsz);
     return ret;
 }
 
@@ -226,7 +233,7 @@ int64 user_console_read(uint64 __user buf, int64 n) {
             // 	release(&cons.lock);
             // 	return -1;
             // }
-            sleep(&cons, &cons.lock);
+            sleep_on(&cons.wq, &cons.lock);
         }
 
         c = cons.buf[cons.r++ % INPUT_BUF_SIZE];
@@ -1,6 +1,7 @@
 #include "debug.h"
 
 #include "defs.h"
+#include "timer.h"
 
 void print_trapframe(struct trapframe *tf) {
     printf("trapframe at %p, epc: %p\n", tf, tf->epc);
@@ -34,17 +35,52 @@ void print_procs() {
         if (p->state == UNUSED)
             continue;
         printf("proc %d: %p\n", i, p);
-        printf("  pid: %d, state: %d\n", p->pid, p->state);
-        printf("  mm: %p\n", p->mm);
+        printf("  pid: %d, state: %d, priority: %d/%d, cpus: %x\n", p->pid, p->state, p->priority, p->base_priority, (int)p->cpumask);
+        printf("  run: %d us, wait: %d us, switches: %d (voluntary %d, involuntary %d)\n",
+               (int)(p->sum_exec_runtime * 1000000 / CPU_FREQ),
+               (int)(p->run_delay * 1000000 / CPU_FREQ),
+               (int)p->nr_runs,
+               (int)p->nr_voluntary,
+               (int)p->nr_involuntary);
+        printf("  mm: %p", p->mm);
+        if (p->mm)
+            printf(" rss: %d", (int)p->mm->rss);
+        printf("\n");
         printf("  parent: %p", p->parent);
         if (p->parent)
             printf(" pid: %d", p->parent->pid);
         printf("\n");
     }
+    print_sched();
 }
+
+void print_sched() {
+    for (int i = 0; i < NCPU; i++) {
+        struct cpu *c = getcpu(i);
+        printf("cpu %d: runq", i);
+#ifdef SCHED_CFS
+        printf(" %d, min_vruntime %p", c->nr_queued, c->min_vruntime);
+#else
+        for (int level = 0; level < SCHED_NR_PRIO; level++) printf(" %d", queue_size(&c->runq[level]));
+#endif
+        printf(", local %d, steal %d, switches %d (direct %d), idle %d ms, ipi %d\n",
+               (int)c->nr_local,
+               (int)c->nr_steal,
+               (int)c->nr_switches,
+               (int)c->nr_direct,
+               (int)(c->idle_time * 1000 / CPU_FREQ),
+               (int)c->nr_ipi);
+        if (c->nr_wakeups)
+            printf("  wakeups %d, latency avg %d us, max %d us\n",
+                   (int)c->nr_wakeups,
+                   (int)(c->wakeup_latency * 1000000 / CPU_FREQ / c->nr_wakeups),
+                   (int)(c->wakeup_latency_max * 1000000 / CPU_FREQ));
+    }
+}
+
 void print_kpgmgr() {
-    extern int64 freepages_count;
-    printf("freepages_count: %d\n", freepages_count);
+    kpgmgr_print_stats();
+    allocator_print_stats();
 }
 
 void print_sysregs(int explain) {
@@ -6,6 +6,7 @@
 // ask clang-format do not sort the includes
 // clang-format off
 
+#include "param.h"
 #include "types.h"
 #include "riscv.h"
 #include "log.h"
@@ -18,14 +19,6 @@
 
 // clang-format on
 
-// Kernel defines
-#define ENABLE_SMP    (1)
-#define NCPU          (4)
-#define NPROC         (512)
-#define KSTRING_MAX   (256)
-#define MAXARG        (32)
-#define PHYS_MEM_SIZE (128ull * 1024 * 1024)
-
 // Common macros
 #define MIN(a, b)      (a < b ? a : b)
 #define MAX(a, b)      (a > b ? a : b)
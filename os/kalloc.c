@@ -1,38 +1,515 @@
 #include "kalloc.h"
 
 #include "defs.h"
+#include "sbi.h"
+#include "timer.h"
 
-struct linklist {
-    struct linklist *next;
+/**
+ * Physical Page Manager: a binary buddy allocator.
+ *
+ * Free memory is kept as naturally aligned blocks of 2^order pages, order in [0, KPAGE_MAX_ORDER].
+ * Each free block is linked into kmem.free_area[order] through a `struct buddy_block` stored in its first page.
+ * The buddy of a block is found by flipping bit `order` of its page frame number (relative to RISCV_DDR_BASE),
+ *  and the PG_BUDDY flag of its descriptor in mem_map[] tells whether it heads a free block of 2^page->order pages.
+ */
+
+struct buddy_block {
+    struct buddy_block *next;
+    struct buddy_block *prev;
 };
 
+#define NR_PAGES       (PHYS_MEM_SIZE / PGSIZE)
+#define PA_TO_PFN(pa)  (((uint64)(pa) - RISCV_DDR_BASE) >> PGSHIFT)
+#define PFN_TO_PA(pfn) (((uint64)(pfn) << PGSHIFT) + RISCV_DDR_BASE)
+
 struct {
-    struct linklist *freelist;
+    struct buddy_block free_area[KPAGE_MAX_ORDER + 1];  // list heads
+    int64 nr_free[KPAGE_MAX_ORDER + 1];                 // number of free blocks of each order
 } kmem;
 
+struct page mem_map[NR_PAGES];
+
 int kalloc_inited = 0;
 
 extern uint64 __kva kpage_allocator_base;
 extern uint64 __kva kpage_allocator_size;
 static spinlock_t kpagelock;
-int64 freepages_count;
+static int64 freepages_count;  // pages in kmem.free_area, protected by kpagelock
+
+// Deferred initialization:
+//  At boot, only the first section of the free region is handed to the buddy allocator.
+//  The remaining sections are added one at a time, by idle harts (see kpgmgr_idle_work),
+//  or on demand when the buddy allocator runs dry. Protected by kpagelock.
+#define KPAGE_SECTION_SIZE (8 * PGSIZE_2M)
+
+static struct {
+    uint64 __kva start;  // [start, end) is not handed to the buddy allocator yet
+    uint64 __kva end;
+    int64 nr_pages;  // pages in [start, end)
+
+    // statistics
+    int nr_sections;  // sections initialized after boot
+    uint64 ticks;     // time spent on them
+} deferred;
+
+// Per-CPU page cache:
+//  Each cpu keeps a small LIFO stack of free pages in front of the buddy allocator.
+//  kallocpage()/kfreepage() only touch the local stack with interrupts off,
+//  and move pages between the stack and the buddy allocator in batches of PCP_BATCH
+//  when it runs empty or grows beyond PCP_HIGH.
+#define PCP_BATCH (16)
+#define PCP_HIGH  (4 * PCP_BATCH)
+
+struct kpage_pcp {
+    struct linklist *freelist;
+    int64 count;
+
+    // statistics
+    uint64 alloc_hit;   // allocations served by the local cache
+    uint64 alloc_miss;  // allocations which had to refill from the buddy allocator
+    uint64 free_hit;    // frees absorbed by the local cache
+    uint64 free_drain;  // frees which had to drain a batch to the buddy allocator
+} __attribute__((aligned(64)));
+
+static struct kpage_pcp pcps[NCPU];
+
+// Pre-zeroed pages:
+//  Idle harts take pages from the buddy allocator and clear them in advance (see kpgmgr_idle_work),
+//  so that kallocpage_zeroed() does not have to clear the page on the hot path.
+#define ZEROED_POOL_HIGH  (256)
+#define ZEROED_POOL_BATCH (8)
+
+static struct {
+    spinlock_t lock;
+    struct linklist *freelist;
+    int64 count;
+
+    // statistics
+    uint64 hit;   // kallocpage_zeroed() served by the pool
+    uint64 miss;  // kallocpage_zeroed() which had to clear the page itself
+} kzero;
+
+// Watermarks, in free pages (see kpgmgr_nr_free):
+//  - user memory is never allocated below min, which is kept for page tables, kernel stacks, etc.
+//    An allocation which would go below it reclaims memory directly. If that is not enough, it fails,
+//    and a kernel allocation of a few pages invokes the OOM killer too.
+//  - below low, idle harts reclaim memory in the background until the free count is back above high.
+// Reclaim gives cached pages back to the buddy allocator, frees the mm of ZOMBIE processes (see reap_zombie_mms)
+//  and the kernel stacks of free proc slots (see shrink_proc_cache).
+static struct {
+    int64 total;  // pages managed by the page allocator
+    int64 min;
+    int64 low;
+    int64 high;
+
+    // statistics
+    uint64 direct;      // direct reclaims
+    uint64 background;  // background reclaims by idle harts
+    uint64 oom_kills;
+} wmark;
+
+// Poisoning: fill freed and newly allocated memory with junk, to catch use-after-free
+//  and reads of uninitialized memory. Only in debug builds (make POISON=y).
+#ifdef KMEM_POISON
+#define kmem_poison(addr, c, size) memset((void *)(addr), (c), (size))
+#else
+#define kmem_poison(addr, c, size) \
+    do {                           \
+    } while (0)
+#endif
+
+// A block of 2^order pages leaves the page allocator: one reference, owned by the kernel.
+static void page_alloced(uint64 __pa pa, int order) {
+    struct page *pg = pa_to_page(pa);
+    pg->refcnt      = 1;
+    pg->mapcount    = 0;
+    pg->type        = PAGE_KERNEL;
+    pg->order       = order;
+    pg->flags       = 0;
+    pg->owner       = NULL;
+}
+
+// A block of 2^order pages goes back to the page allocator.
+static void page_freed(uint64 __pa pa, int order, uint64 ra) {
+    struct page *pg = pa_to_page(pa);
+    if (pg->type == PAGE_FREE)
+        panic("double free %p, called by %p", pa, ra);
+    if (pg->mapcount != 0 || pg->order != order)
+        panic("free %p: mapcount %d, order %d, called by %p", pa, pg->mapcount, order, ra);
+    pg->type   = PAGE_FREE;
+    pg->refcnt = 0;
+    pg->flags  = 0;
+    pg->owner  = NULL;
+}
+
+static int pa_in_allocator(uint64 __pa pa, int order) {
+    uint64 __kva kva = PA_TO_KVA(pa);
+    uint64 __kva end = kpage_allocator_base + kpage_allocator_size;
+    return kpage_allocator_base <= kva && kva < end && kva + (PGSIZE << order) <= end;
+}
+
+static void buddy_list_add(int order, uint64 __pa pa) {
+    struct buddy_block *head = &kmem.free_area[order];
+    struct buddy_block *b    = (struct buddy_block *)PA_TO_KVA(pa);
+    b->next                  = head->next;
+    b->prev                  = head;
+    head->next->prev         = b;
+    head->next               = b;
+
+    struct page *pg = pa_to_page(pa);
+    pg->flags |= PG_BUDDY;
+    pg->order = order;
+    kmem.nr_free[order]++;
+}
+
+static void buddy_list_del(int order, uint64 __pa pa) {
+    struct buddy_block *b = (struct buddy_block *)PA_TO_KVA(pa);
+    b->prev->next         = b->next;
+    b->next->prev         = b->prev;
+
+    pa_to_page(pa)->flags &= ~PG_BUDDY;
+    kmem.nr_free[order]--;
+}
+
+// Free a block of 2^order pages, merging it with its free buddies.
+static void __kfreepages(uint64 __pa pa, int order) {
+    assert(holding(&kpagelock));
+    freepages_count += 1 << order;
+
+    uint64 pfn = PA_TO_PFN(pa);
+    while (order < KPAGE_MAX_ORDER) {
+        uint64 buddy_pfn = pfn ^ (1ull << order);
+        uint64 buddy_pa  = PFN_TO_PA(buddy_pfn);
+        if (buddy_pfn >= NR_PAGES || !pa_in_allocator(buddy_pa, order))
+            break;
+        struct page *buddy = &mem_map[buddy_pfn];
+        if (!(buddy->flags & PG_BUDDY) || buddy->order != order)
+            break;
+        buddy_list_del(order, buddy_pa);
+        pfn &= ~(1ull << order);
+        order++;
+    }
+    buddy_list_add(order, PFN_TO_PA(pfn));
+}
+
+// Carve [start, end) into the largest naturally aligned blocks, and free them.
+static void kpgmgr_carve(uint64 __kva start, uint64 __kva end) {
+    assert(holding(&kpagelock));
+
+    uint64 __kva p = start;
+    while (p < end) {
+        uint64 pfn = PA_TO_PFN(KVA_TO_PA(p));
+        int order  = KPAGE_MAX_ORDER;
+        while (order > 0 && (!IS_ALIGNED(pfn, 1ull << order) || p + (PGSIZE << order) > end)) order--;
+        __kfreepages(KVA_TO_PA(p), order);
+        p += PGSIZE << order;
+    }
+}
+
+// Hand the next deferred section to the buddy allocator.
+// Returns 0 if there is no deferred section left.
+static int kpgmgr_grow() {
+    assert(holding(&kpagelock));
+
+    if (deferred.start >= deferred.end)
+        return 0;
+
+    uint64 t0          = r_time();
+    uint64 __kva start = deferred.start;
+    uint64 __kva end   = MIN(ROUNDUP_2N(start + 1, KPAGE_SECTION_SIZE), deferred.end);
+    kpgmgr_carve(start, end);
+    deferred.start = end;
+    deferred.nr_pages -= (end - start) / PGSIZE;
+    deferred.nr_sections++;
+    deferred.ticks += r_time() - t0;
+
+    if (deferred.start >= deferred.end)
+        infof("deferred page init done: %d sections in %d us", deferred.nr_sections, (int)(deferred.ticks * 1000000 / CPU_FREQ));
+    return 1;
+}
+
+// Allocate a block of 2^order pages, splitting a larger block if necessary.
+static uint64 __pa __kallocpages(int order) {
+    assert(holding(&kpagelock));
+
+    int o;
+    for (;;) {
+        o = order;
+        while (o <= KPAGE_MAX_ORDER && kmem.nr_free[o] == 0) o++;
+        if (o <= KPAGE_MAX_ORDER)
+            break;
+        if (!kpgmgr_grow())
+            return 0;
+    }
+
+    uint64 __pa pa = KVA_TO_PA(kmem.free_area[o].next);
+    buddy_list_del(o, pa);
+
+    // return the upper halves to the lower orders.
+    while (o > order) {
+        o--;
+        buddy_list_add(o, pa + (PGSIZE << o));
+    }
+    freepages_count -= 1 << order;
+    return pa;
+}
+
+// move at most PCP_BATCH pages from the buddy allocator to the local cache.
+static void pcp_refill(struct kpage_pcp *pcp) {
+    acquire(&kpagelock);
+    for (int i = 0; i < PCP_BATCH; i++) {
+        uint64 __pa pa = __kallocpages(0);
+        if (pa == 0)
+            break;
+        struct linklist *l = (struct linklist *)PA_TO_KVA(pa);
+        l->next            = pcp->freelist;
+        pcp->freelist      = l;
+        pcp->count++;
+    }
+    release(&kpagelock);
+}
+
+// move at most nr pages from the local cache back to the buddy allocator.
+static void pcp_drain(struct kpage_pcp *pcp, int64 nr) {
+    acquire(&kpagelock);
+    while (nr-- > 0 && pcp->freelist) {
+        struct linklist *l = pcp->freelist;
+        pcp->freelist      = l->next;
+        pcp->count--;
+        __kfreepages(KVA_TO_PA(l), 0);
+    }
+    release(&kpagelock);
+}
 
 void kpgmgrinit() {
     spinlock_init(&kpagelock, "pageallocator");
+    spinlock_init(&kzero.lock, "zeroedpages");
+    memset(pcps, 0, sizeof(pcps));
+    // mem_map[] is in .bss: all descriptors are PAGE_FREE already, including the deferred ones.
+    for (int o = 0; o <= KPAGE_MAX_ORDER; o++) {
+        kmem.free_area[o].next = kmem.free_area[o].prev = &kmem.free_area[o];
+        kmem.nr_free[o]                                 = 0;
+    }
 
     uint64 kpage_allocator_end = kpage_allocator_base + kpage_allocator_size;
 
     infof("page allocator init: base: %p, stop: %p", kpage_allocator_base, kpage_allocator_end);
 
+    int64 total = kpage_allocator_size / PGSIZE;
+    wmark.total = total;
+    wmark.min   = MAX(total / 64, NCPU * PCP_HIGH);
+    wmark.low   = wmark.min * 5 / 4;
+    wmark.high  = wmark.min * 3 / 2;
+
     assert(PGALIGNED(kpage_allocator_base));
     assert(PGALIGNED(kpage_allocator_end));
+    assert(KVA_TO_PA(kpage_allocator_end) <= RISCV_DDR_BASE + PHYS_MEM_SIZE);
 
-    for (uint64 p = kpage_allocator_end - PGSIZE; p >= kpage_allocator_base; p -= PGSIZE) {
-        kfreepage((void *)KVA_TO_PA(p));
-    }
+    // no other cpus are allocating pages now.
+    // initialize the first section only, and defer the others.
+    uint64 t0          = r_time();
+    uint64 __kva first = MIN(ROUNDUP_2N(kpage_allocator_base + 1, KPAGE_SECTION_SIZE), kpage_allocator_end);
+    acquire(&kpagelock);
+    kpgmgr_carve(kpage_allocator_base, first);
+    deferred.start    = first;
+    deferred.end      = kpage_allocator_end;
+    deferred.nr_pages = (kpage_allocator_end - first) / PGSIZE;
+    release(&kpagelock);
+    uint64 t1 = r_time();
+
+    // estimate the cost of an eager init from what we have just done, reported as a boot banner.
+    int64 boot_pages = (first - kpage_allocator_base) / PGSIZE;
+    printf("page allocator: %d pages ready in %d us, %d pages deferred (saves ~%d us of boot time)\n",
+           (int)boot_pages,
+           (int)((t1 - t0) * 1000000 / CPU_FREQ),
+           (int)deferred.nr_pages,
+           (int)((t1 - t0) * deferred.nr_pages / boot_pages * 1000000 / CPU_FREQ));
     kalloc_inited = 1;
 }
 
+// The number of free pages, including pages held by per-cpu caches.
+int64 kpgmgr_nr_free() {
+    int64 nr = freepages_count + kzero.count + deferred.nr_pages;
+    for (int i = 0; i < NCPU; i++) nr += pcps[i].count;
+    return nr;
+}
+
+// The number of free blocks of 2^order pages in the buddy allocator.
+int64 kpgmgr_nr_free_blocks(int order) {
+    if (order < 0 || order > KPAGE_MAX_ORDER)
+        return -EINVAL;
+    return kmem.nr_free[order];
+}
+
+void kpgmgr_print_stats() {
+    printf("freepages_count: %d (buddy %d, zeroed %d, deferred %d)\n",
+           (int)kpgmgr_nr_free(),
+           (int)freepages_count,
+           (int)kzero.count,
+           (int)deferred.nr_pages);
+
+    // unusable free space index for the largest order:
+    //  the percentage of free pages which cannot serve a 2^KPAGE_MAX_ORDER allocation.
+    int64 nr_max_pages = kmem.nr_free[KPAGE_MAX_ORDER] << KPAGE_MAX_ORDER;
+    printf("buddy: fragmentation %d%%, free blocks:", freepages_count ? (int)((freepages_count - nr_max_pages) * 100 / freepages_count) : 0);
+    for (int o = 0; o <= KPAGE_MAX_ORDER; o++) printf(" %d", (int)kmem.nr_free[o]);
+    printf("\n");
+
+    for (int i = 0; i < NCPU; i++) {
+        struct kpage_pcp *pcp = &pcps[i];
+        uint64 allocs         = pcp->alloc_hit + pcp->alloc_miss;
+        uint64 frees          = pcp->free_hit + pcp->free_drain;
+        printf("  cpu %d: cached %d, alloc %d (hit %d%%), free %d (hit %d%%)\n",
+               i,
+               (int)pcp->count,
+               (int)allocs,
+               allocs ? (int)(pcp->alloc_hit * 100 / allocs) : 0,
+               (int)frees,
+               frees ? (int)(pcp->free_hit * 100 / frees) : 0);
+    }
+    uint64 zeroed = kzero.hit + kzero.miss;
+    printf("  zeroed: alloc %d (hit %d%%)\n", (int)zeroed, zeroed ? (int)(kzero.hit * 100 / zeroed) : 0);
+    printf("watermarks: min %d, low %d, high %d; reclaim: direct %d, background %d; oom kills %d\n",
+           (int)wmark.min,
+           (int)wmark.low,
+           (int)wmark.high,
+           (int)wmark.direct,
+           (int)wmark.background,
+           (int)wmark.oom_kills);
+}
+
+static struct linklist *kzero_pop() {
+    acquire(&kzero.lock);
+    struct linklist *l = kzero.freelist;
+    if (l) {
+        kzero.freelist = l->next;
+        kzero.count--;
+        l->next = NULL;  // the link is the only non-zero word in the page
+    }
+    release(&kzero.lock);
+    return l;
+}
+
+// Give the pages cached by the zeroed pool and by this cpu back to the buddy allocator,
+//  where allocations of any order, on any cpu, can use them.
+static void kpgmgr_flush_caches() {
+    acquire(&kzero.lock);
+    struct linklist *l = kzero.freelist;
+    kzero.freelist     = NULL;
+    kzero.count        = 0;
+    release(&kzero.lock);
+
+    acquire(&kpagelock);
+    for (struct linklist *next; l; l = next) {
+        next = l->next;
+        __kfreepages(KVA_TO_PA(l), 0);
+    }
+    release(&kpagelock);
+
+    push_off();
+    struct kpage_pcp *pcp = &pcps[cpuid()];
+    pcp_drain(pcp, pcp->count);
+    pop_off();
+}
+
+// The number of free pages any cpu can allocate: those in the caches of other cpus are not,
+//  as kpgmgr_flush_caches() only drains the local one.
+static int64 kpgmgr_nr_reachable() {
+    return freepages_count + kzero.count + deferred.nr_pages;
+}
+
+// Reclaim memory until nr pages can be allocated, or nothing is left to reclaim.
+// Returns non-zero if nr pages can be allocated.
+static int kpgmgr_reclaim(int64 nr) {
+    kpgmgr_flush_caches();
+    if (kpgmgr_nr_reachable() < nr)
+        reap_zombie_mms();
+    if (kpgmgr_nr_reachable() < nr)
+        shrink_proc_cache();
+    // reaping frees objects, which may leave slabs empty.
+    if (kpgmgr_nr_reachable() < nr)
+        allocator_shrink_all();
+    return kpgmgr_nr_reachable() >= nr;
+}
+
+// Reclaim all that this cpu can, whatever the free count: its caches and magazines, the mm of zombies,
+//  the kernel stacks of free proc slots and the empty slabs. For tests, see KTEST_RECLAIM.
+void kpgmgr_reclaim_all() {
+    kpgmgr_reclaim(wmark.total + 1);
+}
+
+// Direct reclaim, for an allocation which finds less than nr free pages.
+// If reclaim does not help and oom is set, kill a process to make room for later allocations:
+//  memory is freed when the victim exits, so the current allocation fails anyway.
+// Only small kernel allocations set oom: the victim is rarely the requester, which may hold its own lock,
+//  and a process must not be killed for the sake of another one's user memory.
+static int kpgmgr_direct_reclaim(int64 nr, int oom) {
+    // more than there is: no reclaim can help.
+    if (nr > wmark.total)
+        return 0;
+    __sync_fetch_and_add(&wmark.direct, 1);
+    if (kpgmgr_reclaim(nr))
+        return 1;
+    if (oom && oom_kill() > 0)
+        __sync_fetch_and_add(&wmark.oom_kills, 1);
+    return 0;
+}
+
+// Check that nr pages can be allocated for user memory without going below the min watermark,
+//  reclaiming memory if needed. Returns 0 if so, otherwise -ENOMEM.
+int kpgmgr_reserve(int64 nr) {
+    if (kpgmgr_nr_free() - nr >= wmark.min)
+        return 0;
+    // more than reclaim could ever free.
+    if (nr > wmark.total - wmark.min)
+        return -ENOMEM;
+    return kpgmgr_direct_reclaim(nr + wmark.min, 0) ? 0 : -ENOMEM;
+}
+
+// Called by idle harts from scheduler():
+//  initialize a deferred section, reclaim memory below the low watermark,
+//  or clear a batch of free pages for kallocpage_zeroed().
+// Returns non-zero if any work was done.
+int kpgmgr_idle_work() {
+    int done = 0;
+
+    if (deferred.nr_pages > 0) {
+        acquire(&kpagelock);
+        done = kpgmgr_grow();
+        release(&kpagelock);
+        if (done)
+            return done;
+    }
+
+    int64 nr_free = kpgmgr_nr_free();
+    if (nr_free < wmark.low) {
+        __sync_fetch_and_add(&wmark.background, 1);
+        kpgmgr_reclaim(wmark.high);
+        // no zeroing under pressure: it moves pages out of the buddy allocator.
+        // report progress only, or the idle loop would spin on reclaim.
+        return kpgmgr_nr_free() > nr_free;
+    }
+
+    while (done < ZEROED_POOL_BATCH && kzero.count < ZEROED_POOL_HIGH) {
+        acquire(&kpagelock);
+        uint64 __pa pa = __kallocpages(0);
+        release(&kpagelock);
+        if (pa == 0)
+            break;
+
+        struct linklist *l = (struct linklist *)PA_TO_KVA(pa);
+        memset(l, 0, PGSIZE);
+
+        acquire(&kzero.lock);
+        l->next        = kzero.freelist;
+        kzero.freelist = l;
+        kzero.count++;
+        release(&kzero.lock);
+        done++;
+    }
+    return done;
+}
+
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
@@ -42,40 +519,70 @@ void kfreepage(void *__pa pa) {
     struct linklist *l;
 
     uint64 __kva kvaddr = PA_TO_KVA(pa);
-    if (!PGALIGNED((uint64)pa) || !(kpage_allocator_base <= kvaddr && kvaddr < kpage_allocator_base + kpage_allocator_size))
+    if (!PGALIGNED((uint64)pa) || !pa_in_allocator((uint64)pa, 0))
         panic("invalid page %p", pa);
-    memset((void *)kvaddr, 0xdd, PGSIZE);
+    page_freed((uint64)pa, 0, ra);
+    kmem_poison(kvaddr, 0xdd, PGSIZE);
 
     if (kalloc_inited)
         debugf("free: %p, called by %p", pa, ra);
 
-    acquire(&kpagelock);
-    l             = (struct linklist *)kvaddr;
-    l->next       = kmem.freelist;
-    kmem.freelist = l;
-    freepages_count++;
-    release(&kpagelock);
+    push_off();
+    struct kpage_pcp *pcp = &pcps[cpuid()];
+    l                     = (struct linklist *)kvaddr;
+    l->next               = pcp->freelist;
+    pcp->freelist         = l;
+    pcp->count++;
+    if (pcp->count > PCP_HIGH) {
+        pcp_drain(pcp, PCP_BATCH);
+        pcp->free_drain++;
+    } else {
+        pcp->free_hit++;
+    }
+    pop_off();
+}
+
+// Take a free page from the local cache, the buddy allocator or the zeroed pool.
+static struct linklist *__kallocpage() {
+    struct linklist *l;
+
+    push_off();
+    struct kpage_pcp *pcp = &pcps[cpuid()];
+    if (pcp->freelist) {
+        pcp->alloc_hit++;
+    } else {
+        pcp_refill(pcp);
+        pcp->alloc_miss++;
+    }
+    l = pcp->freelist;
+    if (l) {
+        pcp->freelist = l->next;
+        pcp->count--;
+    }
+    pop_off();
+
+    // the last resort: pages pre-zeroed by idle harts.
+    if (l == NULL)
+        l = kzero_pop();
+    return l;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *__pa kallocpage() {
-    uint64 ra = r_ra();  // who calls me?
+    uint64 ra          = r_ra();  // who calls me?
+    struct linklist *l = __kallocpage();
 
-    acquire(&kpagelock);
-    struct linklist *l;
-    l = kmem.freelist;
-    if (l) {
-        kmem.freelist = l->next;
-        freepages_count--;
-    }
-    release(&kpagelock);
-    
-    debugf("alloc: %p, by %p", KVA_TO_PA(l), ra);
+    if (l == NULL && kpgmgr_direct_reclaim(1, 1))
+        l = __kallocpage();
+
+    if (kalloc_inited)
+        debugf("alloc: %p, by %p", KVA_TO_PA(l), ra);
 
     if (l != NULL) {
-        memset((char *)l, 0xaf, PGSIZE);  // fill with junk
+        page_alloced(KVA_TO_PA(l), 0);
+        kmem_poison(l, 0xaf, PGSIZE);  // fill with junk
     } else {
         warnf("out of memory, called by %p", ra);
         return 0;
@@ -83,87 +590,463 @@ void *__pa kallocpage() {
     return (void *)KVA_TO_PA((uint64)l);
 }
 
+// Allocate one page of physical memory filled with zeros.
+// Prefer pages cleared in advance by idle harts.
+void *__pa kallocpage_zeroed() {
+    struct linklist *l = kzero_pop();
+    if (l) {
+        __sync_fetch_and_add(&kzero.hit, 1);
+        page_alloced(KVA_TO_PA(l), 0);
+        return (void *)KVA_TO_PA(l);
+    }
+
+    void *__pa pa = kallocpage();
+    if (pa == NULL)
+        return NULL;
+    memset((void *)PA_TO_KVA(pa), 0, PGSIZE);
+    __sync_fetch_and_add(&kzero.miss, 1);
+    return pa;
+}
+
+// Free a block of 2^order physically contiguous pages returned by kallocpages(order).
+void kfreepages(void *__pa pa, int order) {
+    uint64 ra = r_ra();  // who calls me?
+
+    if (order < 0 || order > KPAGE_MAX_ORDER)
+        panic("invalid order %d", order);
+    if (!IS_ALIGNED((uint64)pa, PGSIZE << order) || !pa_in_allocator((uint64)pa, order))
+        panic("invalid pages %p, order %d", pa, order);
+    page_freed((uint64)pa, order, ra);
+    kmem_poison(PA_TO_KVA(pa), 0xdd, PGSIZE << order);
+
+    if (kalloc_inited)
+        debugf("free: %p, order %d, called by %p", pa, order, ra);
+
+    acquire(&kpagelock);
+    __kfreepages((uint64)pa, order);
+    release(&kpagelock);
+}
+
+// Allocate a block of 2^order physically contiguous pages, aligned to its size.
+// Returns 0 if the memory cannot be allocated.
+void *__pa kallocpages(int order) {
+    uint64 ra = r_ra();  // who calls me?
+
+    if (order < 0 || order > KPAGE_MAX_ORDER)
+        panic("invalid order %d", order);
+    if (order == 0)
+        return kallocpage();
+
+    acquire(&kpagelock);
+    uint64 __pa pa = __kallocpages(order);
+    release(&kpagelock);
+
+    // flushing the caches may also merge free pages into a block large enough.
+    if (pa == 0 && kpgmgr_direct_reclaim(1 << order, 1)) {
+        acquire(&kpagelock);
+        pa = __kallocpages(order);
+        release(&kpagelock);
+    }
+
+    if (kalloc_inited)
+        debugf("alloc: %p, order %d, by %p", pa, order, ra);
+
+    if (pa == 0) {
+        warnf("out of memory, order %d, called by %p", order, ra);
+        return 0;
+    }
+    page_alloced(pa, order);
+    kmem_poison(PA_TO_KVA(pa), 0xaf, PGSIZE << order);  // fill with junk
+    return (void *)pa;
+}
+
+// Take n pages into out[] from the local cache and the buddy allocator, taking kpagelock at most once.
+// All or nothing: returns 0 on success, or -ENOMEM without taking any page.
+static int __kallocpages_bulk(int n, void *__pa out[]) {
+    int got = 0;
+
+    push_off();
+    struct kpage_pcp *pcp = &pcps[cpuid()];
+    if (pcp->count < n) {
+        acquire(&kpagelock);
+        if (pcp->count + freepages_count + deferred.nr_pages < n) {
+            release(&kpagelock);
+            pop_off();
+            return -ENOMEM;
+        }
+        while (pcp->count + got < n) out[got++] = (void *)__kallocpages(0);
+        release(&kpagelock);
+        pcp->alloc_miss++;
+    } else {
+        pcp->alloc_hit++;
+    }
+    while (got < n) {
+        struct linklist *l = pcp->freelist;
+        pcp->freelist      = l->next;
+        pcp->count--;
+        out[got++] = (void *)KVA_TO_PA(l);
+    }
+    pop_off();
+    return 0;
+}
+
+// Allocate n pages into out[].
+// All or nothing: returns 0 on success, or -ENOMEM without allocating any page.
+int kallocpages_bulk(int n, void *__pa out[]) {
+    uint64 ra = r_ra();  // who calls me?
+
+    // as kallocpage(): the free pages may be in the caches of other cpus or in the zeroed pool.
+    // Batches are for user memory, reserved by kpgmgr_reserve(): no OOM killer.
+    int ret = __kallocpages_bulk(n, out);
+    if (ret < 0 && kpgmgr_direct_reclaim(n, 0))
+        ret = __kallocpages_bulk(n, out);
+    if (ret < 0) {
+        warnf("out of memory, %d pages requested, called by %p", n, ra);
+        return ret;
+    }
+
+    for (int i = 0; i < n; i++) {
+        page_alloced((uint64)out[i], 0);
+        kmem_poison(PA_TO_KVA(out[i]), 0xaf, PGSIZE);  // fill with junk
+    }
+
+    if (kalloc_inited)
+        debugf("alloc: %d pages, by %p", n, ra);
+    return 0;
+}
+
+// Same as kallocpages_bulk, but the pages are filled with zeros.
+int kallocpages_bulk_zeroed(int n, void *__pa out[]) {
+    int got = 0;
+
+    // take what we can from the pre-zeroed pool first.
+    acquire(&kzero.lock);
+    while (got < n && kzero.freelist) {
+        struct linklist *l = kzero.freelist;
+        kzero.freelist     = l->next;
+        kzero.count--;
+        l->next    = NULL;
+        out[got++] = (void *)KVA_TO_PA(l);
+    }
+    release(&kzero.lock);
+
+    if (got < n && kallocpages_bulk(n - got, &out[got]) < 0) {
+        // put the zeroed pages back.
+        acquire(&kzero.lock);
+        while (got > 0) {
+            struct linklist *l = (struct linklist *)PA_TO_KVA(out[--got]);
+            l->next            = kzero.freelist;
+            kzero.freelist     = l;
+            kzero.count++;
+        }
+        release(&kzero.lock);
+        return -ENOMEM;
+    }
+
+    __sync_fetch_and_add(&kzero.hit, got);
+    __sync_fetch_and_add(&kzero.miss, n - got);
+    for (int i = 0; i < got; i++) page_alloced((uint64)out[i], 0);
+    for (int i = got; i < n; i++) memset((void *)PA_TO_KVA(out[i]), 0, PGSIZE);
+    return 0;
+}
+
+// Link a page to be freed by kfreepages_list(). The page itself holds the link.
+void kpagelist_add(struct linklist **list, void *__pa pa) {
+    struct linklist *l = (struct linklist *)PA_TO_KVA(pa);
+    l->next            = *list;
+    *list              = l;
+}
+
+// Free a list of pages linked through their first word (see kpagelist_add),
+//  taking kpagelock at most once.
+void kfreepages_list(struct linklist *list) {
+    uint64 ra = r_ra();  // who calls me?
+    struct linklist *l, *next;
+
+    for (l = list; l; l = l->next) {
+        if (!pa_in_allocator(KVA_TO_PA(l), 0))
+            panic("invalid page %p, called by %p", KVA_TO_PA(l), ra);
+        page_freed(KVA_TO_PA(l), 0, ra);
+    }
+
+    push_off();
+    struct kpage_pcp *pcp = &pcps[cpuid()];
+
+    // the local cache absorbs what it can,
+    for (l = list; l && pcp->count < PCP_HIGH; l = next) {
+        next = l->next;
+        kmem_poison(l, 0xdd, PGSIZE);
+        l->next       = pcp->freelist;
+        pcp->freelist = l;
+        pcp->count++;
+    }
+    // and the remaining go to the buddy allocator.
+    if (l) {
+        acquire(&kpagelock);
+        for (; l; l = next) {
+            next = l->next;
+            kmem_poison(l, 0xdd, PGSIZE);
+            __kfreepages(KVA_TO_PA(l), 0);
+        }
+        release(&kpagelock);
+        pcp->free_drain++;
+    } else {
+        pcp->free_hit++;
+    }
+    pop_off();
+
+    if (kalloc_inited)
+        debugf("free: page list %p, called by %p", list, ra);
+}
+
 // Object Allocator
+
+// A slab is 2^slab_order pages, mapped at a slot of the allocator's window, aligned to its size.
+//  The header is at the beginning of the slab, followed by the objects:
+//  [struct slab][linklist, object][linklist, object]...[linklist, object]..
+//  The linklist in front of each object links the free objects of the slab.
+struct slab {
+    struct slab_list link;  // in alloc->partial or alloc->empty, not linked when full
+    struct linklist *freelist;
+    int inuse;
+    uint64 __pa pa;
+};
+
+// A slab being freed by allocator_shrink_all(), stored in its first page through the direct mapping.
+struct slab_victim {
+    struct slab_victim *next;
+    struct allocator *alloc;
+    uint64 __kva va;
+};
+
+#define SLAB_HEADER_SIZE  ROUNDUP_2N(sizeof(struct slab), 8)
+#define SLAB_MIN_OBJECTS  (8)
+#define SLAB_MAX_ORDER    (3)
+#define SLAB_SIZE(alloc)  (PGSIZE << (alloc)->slab_order)
+#define OBJ_TO_LINK(obj)  ((struct linklist *)((uint64)(obj) - sizeof(struct linklist)))
+#define LINK_TO_OBJ(l)    ((void *)((uint64)(l) + sizeof(struct linklist)))
+
 static uint64 allocator_mapped_va = KERNEL_ALLOCATOR_BASE;
+static struct allocator *allocators;  // all allocators, linked at boot
 
-void allocator_init(struct allocator *alloc, char *name, uint64 object_size, uint64 count) {
-    // Under NOMMU mode, we require the sizeof([header, object]) is smaller than a page.
-    // assert(object_size < PGSIZE - sizeof(struct linklist));
+static void slab_list_init(struct slab_list *head) {
+    head->next = head->prev = head;
+}
 
-    // The allocator leaves spaces for a `struct linklist` before every object:
-    //  [PGALIGNED][linklist, object][linklist, object]...[linklist, object]..[PGALIGNED]
-    //             ^__pool_base, first object             ^_ the last obj               ^__pool_end
+static int slab_list_empty(struct slab_list *head) {
+    return head->next == head;
+}
 
+static void slab_list_add(struct slab_list *head, struct slab *slab) {
+    struct slab_list *l = &slab->link;
+    l->next             = head->next;
+    l->prev             = head;
+    head->next->prev    = l;
+    head->next          = l;
+}
+
+static void slab_list_del(struct slab *slab) {
+    slab->link.prev->next = slab->link.next;
+    slab->link.next->prev = slab->link.prev;
+}
+
+// pool_base is aligned to KERNEL_ALLOCATOR_GAP, so slabs are naturally aligned.
+static struct slab *obj_to_slab(struct allocator *alloc, void *obj) {
+    return (struct slab *)((uint64)obj & ~(SLAB_SIZE(alloc) - 1));
+}
+
+void allocator_init(struct allocator *alloc, char *name, uint64 object_size, uint64 count) {
+    allocator_init_ctor(alloc, name, object_size, count, NULL);
+}
+
+// An allocator whose objects are constructed by ctor once, when their slab is created.
+// kfree() must be given objects in their constructed state, e.g., with the spinlocks released,
+//  so that kalloc() returns them ready to use.
+void allocator_init_ctor(struct allocator *alloc, char *name, uint64 object_size, uint64 count, void (*ctor)(void *)) {
     memset(alloc, 0, sizeof(*alloc));
     // record basic properties of the allocator
     alloc->name = name;
+    alloc->ctor = ctor;
     spinlock_init(&alloc->lock, "allocator");
     alloc->object_size         = object_size;
     alloc->object_size_aligned = ROUNDUP_2N(object_size + sizeof(struct linklist), 8);
     alloc->max_count           = count;
+    slab_list_init(&alloc->partial);
+    slab_list_init(&alloc->empty);
 
-    assert(count <= PGSIZE * 8);
+    // the smallest slab holding SLAB_MIN_OBJECTS objects.
+    for (alloc->slab_order = 0;; alloc->slab_order++) {
+        alloc->objs_per_slab = (SLAB_SIZE(alloc) - SLAB_HEADER_SIZE) / alloc->object_size_aligned;
+        if (alloc->objs_per_slab >= SLAB_MIN_OBJECTS || alloc->slab_order == SLAB_MAX_ORDER)
+            break;
+    }
+    if (alloc->objs_per_slab == 0)
+        panic("allocator %s: object size %d too large", name, (int)object_size);
 
-    // calculate how many pages do we need
-    uint64 total_size = alloc->object_size_aligned * alloc->max_count;
-    total_size        = PGROUNDUP(total_size);
+    // reserve a window large enough for count objects. Slabs are mapped on demand.
+    uint64 nr_slots = (count + alloc->objs_per_slab - 1) / alloc->objs_per_slab;
+    assert(nr_slots <= ALLOCATOR_MAX_SLABS);
+    uint64 total_size = nr_slots * SLAB_SIZE(alloc);
 
-    // calculate the pool base and end.
     alloc->pool_base = allocator_mapped_va;
     alloc->pool_end  = alloc->pool_base + total_size;
 
-    infof("allocator %s inited base %p", name, alloc->pool_base);
+    infof("allocator %s inited base %p, %d objects per slab of %d pages",
+          name,
+          alloc->pool_base,
+          alloc->objs_per_slab,
+          1 << alloc->slab_order);
 
     // add a significant gap between different types of objects.
     allocator_mapped_va += ROUNDUP_2N(total_size, KERNEL_ALLOCATOR_GAP);
 
-    // allocate physical pages and kvmmap [pool_base, pool_end)
-    for (uint64 va = alloc->pool_base; va < alloc->pool_end; va += PGSIZE) {
-        void *__pa pg = kallocpage();
-        if (pg == NULL)
-            panic("kallocpage");
-        memset((void *)PA_TO_KVA(pg), 0xf8, PGSIZE);
-        kvmmap(kernel_pagetable, va, (uint64)pg, PGSIZE, PTE_A | PTE_D | PTE_R | PTE_W);
+    // page-table pages are created now, so that slabs can be mapped and unmapped at any time.
+    kvmreserve(kernel_pagetable, alloc->pool_base, total_size);
+
+    alloc->next = allocators;
+    allocators  = alloc;
+}
+
+// Map a new slab in a free slot of the window. Must be called without alloc->lock:
+//  the page allocator may reclaim memory, which frees objects.
+static struct slab *slab_create(struct allocator *alloc) {
+    uint64 nr_slots = (alloc->pool_end - alloc->pool_base) / SLAB_SIZE(alloc);
+    int64 slot      = -1;
+
+    acquire(&alloc->lock);
+    for (uint64 i = 0; i < nr_slots; i++) {
+        if (!(alloc->slab_map[i / 64] & (1ull << (i % 64)))) {
+            alloc->slab_map[i / 64] |= 1ull << (i % 64);
+            slot = i;
+            break;
+        }
+    }
+    release(&alloc->lock);
+    if (slot < 0) {
+        warnf("allocator %s: window is full", alloc->name);
+        return NULL;
+    }
+
+    void *__pa pa = kallocpages(alloc->slab_order);
+    if (pa == NULL) {
+        acquire(&alloc->lock);
+        alloc->slab_map[slot / 64] &= ~(1ull << (slot % 64));
+        release(&alloc->lock);
+        return NULL;
+    }
+    for (int i = 0; i < (1 << alloc->slab_order); i++) {
+        struct page *pg = pa_to_page((uint64)pa + i * PGSIZE);
+        pg->type        = PAGE_SLAB;
+        pg->owner       = alloc;
     }
+
+    // the slot is either never mapped, or unmapped and flushed on all harts by allocator_shrink_all().
+    uint64 __kva va = alloc->pool_base + slot * SLAB_SIZE(alloc);
+    kvmmap(kernel_pagetable, va, (uint64)pa, SLAB_SIZE(alloc), PTE_A | PTE_D | PTE_R | PTE_W);
     sfence_vma();
+    kmem_poison(va, 0xf8, SLAB_SIZE(alloc));
 
-    // init the freelist:
-    for (uint64 i = 0, addr = alloc->pool_base; i < alloc->max_count; i++) {
-        assert(addr + alloc->object_size_aligned <= alloc->pool_end);
-        struct linklist *l = (struct linklist *)addr;
-        l->next            = alloc->freelist;
-        alloc->freelist    = l;
-        addr += alloc->object_size_aligned;
+    struct slab *slab = (struct slab *)va;
+    slab->freelist    = NULL;
+    slab->inuse       = 0;
+    slab->pa          = (uint64)pa;
+    for (int i = alloc->objs_per_slab - 1; i >= 0; i--) {
+        struct linklist *l = (struct linklist *)(va + SLAB_HEADER_SIZE + i * alloc->object_size_aligned);
+        l->next            = slab->freelist;
+        slab->freelist     = l;
+        if (alloc->ctor)
+            alloc->ctor(LINK_TO_OBJ(l));
     }
-
-    alloc->available_count = alloc->max_count;
-    alloc->allocated_count = 0;
+    return slab;
 }
 
-void *kalloc(struct allocator *alloc) {
-    assert(alloc);
-    acquire(&alloc->lock);
+// Fill the local magazine up to half, growing the allocator by one slab if needed.
+// Called with interrupts off.
+static void allocator_refill(struct allocator *alloc, struct allocator_magazine *mag) {
+    struct slab *new_slab = NULL;
 
-    if (alloc->available_count == 0)
-        panic("unavailable");
+    for (;;) {
+        acquire(&alloc->lock);
+        if (new_slab) {
+            slab_list_add(&alloc->empty, new_slab);
+            alloc->nr_slabs++;
+            alloc->nr_empty++;
+        }
+        while (mag->count < ALLOCATOR_MAG_SIZE / 2 && alloc->inuse < alloc->max_count) {
+            struct slab *slab;
+            if (!slab_list_empty(&alloc->partial)) {
+                slab = (struct slab *)alloc->partial.next;
+            } else if (!slab_list_empty(&alloc->empty)) {
+                slab = (struct slab *)alloc->empty.next;
+                slab_list_del(slab);
+                slab_list_add(&alloc->partial, slab);
+                alloc->nr_empty--;
+            } else {
+                break;
+            }
+            struct linklist *l = slab->freelist;
+            slab->freelist     = l->next;
+            if (++slab->inuse == alloc->objs_per_slab)
+                slab_list_del(slab);  // full
+            alloc->inuse++;
+            mag->objs[mag->count++] = LINK_TO_OBJ(l);
+        }
+        int done = mag->count > 0 || alloc->inuse >= alloc->max_count || new_slab;
+        release(&alloc->lock);
+        if (done)
+            return;
+        if ((new_slab = slab_create(alloc)) == NULL)
+            return;
+    }
+}
 
-    alloc->available_count--;
+// Give nr objects of the local magazine back to their slabs.
+// Called with alloc->lock held.
+static void allocator_flush(struct allocator *alloc, struct allocator_magazine *mag, int nr) {
+    assert(holding(&alloc->lock));
+    while (nr-- > 0 && mag->count > 0) {
+        void *obj          = mag->objs[--mag->count];
+        struct slab *slab  = obj_to_slab(alloc, obj);
+        struct linklist *l = OBJ_TO_LINK(obj);
+        l->next            = slab->freelist;
+        slab->freelist     = l;
+        if (slab->inuse-- == alloc->objs_per_slab)
+            slab_list_add(&alloc->partial, slab);  // no longer full
+        if (slab->inuse == 0) {
+            slab_list_del(slab);
+            slab_list_add(&alloc->empty, slab);
+            alloc->nr_empty++;
+        }
+        alloc->inuse--;
+    }
+}
 
-    void *ret;
+// Returns NULL if the allocator has max_count objects allocated already, or memory runs out.
+void *kalloc(struct allocator *alloc) {
+    assert(alloc);
 
-    struct linklist *l = alloc->freelist;
-    if (l) {
-        alloc->freelist = l->next;
-        ret             = (void *)((uint64)l + sizeof(*l));
+    void *ret = NULL;
 
-        alloc->allocated_count++;
+    push_off();
+    struct allocator_magazine *mag = &alloc->mags[cpuid()];
+    if (mag->count == 0)
+        allocator_refill(alloc, mag);
+    if (mag->count > 0)
+        ret = mag->objs[--mag->count];
+    pop_off();
 
-        memset(l, 0xff, sizeof(*l));
-        memset(ret, 0xfe, alloc->object_size);
-    } else {
-        panic("should be guarded by available_count");
+    if (ret == NULL) {
+        warnf("kalloc(%s): unavailable", alloc->name);
+        return NULL;
     }
-    release(&alloc->lock);
+
+#ifdef KMEM_POISON
+    // catch reads of uninitialized fields, then construct the object again.
+    kmem_poison(OBJ_TO_LINK(ret), 0xff, sizeof(struct linklist));
+    kmem_poison(ret, 0xfe, alloc->object_size);
+    if (alloc->ctor)
+        alloc->ctor(ret);
+#endif
 
     tracef("kalloc(%s) returns %p", alloc->name, ret);
 
@@ -177,18 +1060,141 @@ void kfree(struct allocator *alloc, void *obj) {
     assert(alloc);
     assert(alloc->pool_base <= (uint64)obj && (uint64)obj < alloc->pool_end);
 
-    memset(obj, 0xfa, alloc->object_size);
+    kmem_poison(obj, 0xfa, alloc->object_size);
 
-    acquire(&alloc->lock);
+    push_off();
+    struct allocator_magazine *mag = &alloc->mags[cpuid()];
+    if (mag->count == ALLOCATOR_MAG_SIZE) {
+        acquire(&alloc->lock);
+        allocator_flush(alloc, mag, ALLOCATOR_MAG_SIZE / 2);
+        release(&alloc->lock);
+    }
+    mag->objs[mag->count++] = obj;
+    pop_off();
+}
+
+// The number of objects which can still be allocated.
+// Objects cached in magazines are not allocated, so this is exact when the allocator is idle.
+uint64 allocator_available(struct allocator *alloc) {
+    uint64 cached = 0;
+    for (int i = 0; i < NCPU; i++) cached += alloc->mags[i].count;
+    return alloc->max_count - alloc->inuse + cached;
+}
 
-    // put the object back to the freelist.
-    struct linklist *l = (struct linklist *)((uint64)obj - sizeof(*l));
-    l->next            = alloc->freelist;
-    alloc->freelist    = l;
+// Reclaim: return the empty slabs of all allocators to the page allocator.
+// Busy allocators are skipped, and only the local magazines are flushed:
+//  the magazines of other cpus can only be touched by them.
+// Returns the number of pages freed.
+int64 allocator_shrink_all() {
+    struct slab_victim *victims = NULL;
+    int64 nr_pages              = 0;
 
-    alloc->allocated_count--;
-    alloc->available_count++;
-    assert(alloc->allocated_count + alloc->available_count == alloc->max_count);
+    for (struct allocator *alloc = allocators; alloc; alloc = alloc->next) {
+        push_off();
+        if (!try_acquire(&alloc->lock)) {
+            pop_off();
+            continue;
+        }
+        struct allocator_magazine *mag = &alloc->mags[cpuid()];
+        allocator_flush(alloc, mag, mag->count);
 
-    release(&alloc->lock);
-}
\ No newline at end of file
+        // unmap the empty slabs. Their slots stay reserved until the TLBs are flushed.
+        while (!slab_list_empty(&alloc->empty)) {
+            struct slab *slab = (struct slab *)alloc->empty.next;
+            uint64 __pa pa    = slab->pa;
+            slab_list_del(slab);
+            kvmunmap(kernel_pagetable, (uint64)slab, SLAB_SIZE(alloc));
+
+            struct slab_victim *v = (struct slab_victim *)PA_TO_KVA(pa);
+            v->next               = victims;
+            v->alloc              = alloc;
+            v->va                 = (uint64)slab;
+            victims               = v;
+            alloc->nr_slabs--;
+            alloc->nr_empty--;
+            nr_pages += 1 << alloc->slab_order;
+        }
+        release(&alloc->lock);
+        pop_off();
+    }
+    if (victims == NULL)
+        return 0;
+
+    // other harts may still cache the translations of the slabs.
+    sbi_remote_sfence_vma(KERNEL_ALLOCATOR_BASE, allocator_mapped_va - KERNEL_ALLOCATOR_BASE);
+
+    for (struct slab_victim *v = victims, *next; v; v = next) {
+        next                    = v->next;
+        struct allocator *alloc = v->alloc;
+        uint64 slot             = (v->va - alloc->pool_base) / SLAB_SIZE(alloc);
+        kfreepages((void *)KVA_TO_PA(v), alloc->slab_order);
+
+        acquire(&alloc->lock);
+        alloc->slab_map[slot / 64] &= ~(1ull << (slot % 64));
+        release(&alloc->lock);
+    }
+    infof("reclaim: %d pages of empty slabs freed", (int)nr_pages);
+    return nr_pages;
+}
+
+void allocator_print_stats() {
+    for (struct allocator *alloc = allocators; alloc; alloc = alloc->next) {
+        printf("allocator %s: %d slabs (%d empty) of %d pages, %d objects in use, %d available\n",
+               alloc->name,
+               (int)alloc->nr_slabs,
+               (int)alloc->nr_empty,
+               1 << alloc->slab_order,
+               (int)alloc->inuse,
+               (int)allocator_available(alloc));
+    }
+}
+
+// kmalloc: general-purpose buffers.
+//  Sizes up to KMALLOC_MAX_CACHED are served by one allocator per power-of-two size class,
+//  larger ones by whole pages from the page allocator.
+#define KMALLOC_MIN_SHIFT  (4)
+#define KMALLOC_MAX_SHIFT  (11)
+#define KMALLOC_MAX_CACHED (1 << KMALLOC_MAX_SHIFT)
+#define KMALLOC_NR_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+#define KMALLOC_CLASS_MEM  (8 * 1024 * 1024)  // bytes of objects a size class can hold
+
+static allocator_t kmalloc_caches[KMALLOC_NR_CLASSES];
+static char *kmalloc_names[KMALLOC_NR_CLASSES] = {
+    "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-128", "kmalloc-256", "kmalloc-512", "kmalloc-1k", "kmalloc-2k",
+};
+
+// The index of the size class of size, or the page order if size > KMALLOC_MAX_CACHED.
+static int kmalloc_index(uint64 size) {
+    int shift = KMALLOC_MIN_SHIFT;
+    while ((1ull << shift) < size) shift++;
+    return size > KMALLOC_MAX_CACHED ? MAX(shift - PGSHIFT, 0) : shift - KMALLOC_MIN_SHIFT;
+}
+
+void kmalloc_init() {
+    for (int i = 0; i < KMALLOC_NR_CLASSES; i++) {
+        uint64 size = 1ull << (i + KMALLOC_MIN_SHIFT);
+        allocator_init(&kmalloc_caches[i], kmalloc_names[i], size, KMALLOC_CLASS_MEM / size);
+    }
+}
+
+// Allocate a buffer of size bytes. Returns NULL if size is 0, larger than 2^KPAGE_MAX_ORDER pages,
+//  or out of memory. The buffer must be freed by kfree_sized() with the same size.
+void *kmalloc(uint64 size) {
+    if (size == 0 || size > (PGSIZE << KPAGE_MAX_ORDER))
+        return NULL;
+    if (size <= KMALLOC_MAX_CACHED)
+        return kalloc(&kmalloc_caches[kmalloc_index(size)]);
+
+    void *__pa pa = kallocpages(kmalloc_index(size));
+    return pa ? (void *)PA_TO_KVA(pa) : NULL;
+}
+
+void kfree_sized(void *p, uint64 size) {
+    if (p == NULL)
+        return;
+    assert(size > 0 && size <= (PGSIZE << KPAGE_MAX_ORDER));
+    if (size <= KMALLOC_MAX_CACHED)
+        kfree(&kmalloc_caches[kmalloc_index(size)], p);
+    else
+        kfreepages((void *)KVA_TO_PA(p), kmalloc_index(size));
+}
@@ -1,33 +1,132 @@
 #ifndef KALLOC_H
 #define KALLOC_H
 
+#include "memlayout.h"
+#include "param.h"
 #include "vm.h"
 
+struct linklist {
+    struct linklist *next;
+};
+
+// Physical page descriptors:
+//  mem_map[] holds one `struct page` for each page in [RISCV_DDR_BASE, RISCV_DDR_BASE + PHYS_MEM_SIZE).
+//  It lives in .bss, so every descriptor starts as a PAGE_FREE page with no flags.
+
+enum page_type {
+    PAGE_FREE = 0,  // owned by the page allocator: buddy, per-cpu caches or the zeroed pool
+    PAGE_KERNEL,    // kernel data: kernel stacks, trapframes, buffers
+    PAGE_PGTABLE,   // a page-table page
+    PAGE_USER,      // mapped into user space
+    PAGE_SLAB,      // backing an object allocator, see page->owner
+};
+
+#define PG_BUDDY (1 << 0)  // head of a free block in the buddy allocator, protected by kpagelock
+#define PG_COW   (1 << 1)  // user page shared copy-on-write
+
+struct allocator;
+
+struct page {
+    int32 refcnt;    // references held by mappings and the kernel, updated atomically
+    int32 mapcount;  // the number of user PTEs mapping this page, updated atomically
+    uint32 flags;    // PG_*
+    uint8 type;      // enum page_type
+    uint8 order;     // a block head has 2^order pages
+    struct allocator *owner;  // PAGE_SLAB: the object allocator using this page
+};
+
+extern struct page mem_map[];
+
+static inline struct page *pa_to_page(uint64 __pa pa) {
+    return &mem_map[(pa - RISCV_DDR_BASE) >> PGSHIFT];
+}
+
+static inline uint64 __pa page_to_pa(struct page *pg) {
+    return ((uint64)(pg - mem_map) << PGSHIFT) + RISCV_DDR_BASE;
+}
+
+static inline void page_set_type(uint64 __pa pa, int type) {
+    pa_to_page(pa)->type = type;
+}
+
+// Physical Page Manager:
+
+// kallocpages(order) returns 2^order physically contiguous pages, up to 2 MiB.
+#define KPAGE_MAX_ORDER (9)
+
 void kpgmgrinit();
 void kfreepage(void *pa);
 void *__pa kallocpage();
+void *__pa kallocpage_zeroed();
+void kfreepages(void *__pa pa, int order);
+void *__pa kallocpages(int order);
+int kallocpages_bulk(int n, void *__pa out[]);
+int kallocpages_bulk_zeroed(int n, void *__pa out[]);
+void kpagelist_add(struct linklist **list, void *__pa pa);
+void kfreepages_list(struct linklist *list);
+int64 kpgmgr_nr_free();
+int kpgmgr_reserve(int64 nr);
+void kpgmgr_reclaim_all();
+int64 kpgmgr_nr_free_blocks(int order);
+void kpgmgr_print_stats();
+int kpgmgr_idle_work();
 
 // Object Allocator:
+//  a slab allocator. Objects are carved from slabs of 2^slab_order pages,
+//  mapped on demand into the allocator's virtual window [pool_base, pool_end) above KERNEL_ALLOCATOR_BASE.
+//  Each cpu keeps a magazine of free objects, used by kalloc()/kfree() without taking the lock.
+
+#define ALLOCATOR_MAG_SIZE  (16)
+#define ALLOCATOR_MAX_SLABS (4096)
+
+struct allocator_magazine {
+    int count;
+    void *objs[ALLOCATOR_MAG_SIZE];
+} __attribute__((aligned(64)));
+
+struct slab_list {
+    struct slab_list *next;
+    struct slab_list *prev;
+};
 
 typedef struct allocator {
     char * name;
     spinlock_t lock;
+    struct allocator *next;  // in the list of all allocators, see allocator_shrink_all()
 
-    struct linklist *freelist;
-    
     uint64 __kva pool_base;
     uint64 __kva pool_end;
 
     uint64 object_size;
     uint64 object_size_aligned;
+    void (*ctor)(void *obj);  // optional constructor
+    int slab_order;
+    int objs_per_slab;
+
+    // protected by lock:
+    struct slab_list partial;  // slabs with both free and allocated objects
+    struct slab_list empty;    // slabs with free objects only
+    int64 nr_slabs;
+    int64 nr_empty;
+    uint64 inuse;  // objects out of the slabs, including those in magazines
+    uint64 slab_map[ALLOCATOR_MAX_SLABS / 64];  // slots of the window in use
 
-    uint64 allocated_count;
-    uint64 available_count;
     uint64 max_count;
+
+    struct allocator_magazine mags[NCPU];
 } allocator_t;
 
 void allocator_init(struct allocator *alloc, char *name, uint64 object_size, uint64 count);
+void allocator_init_ctor(struct allocator *alloc, char *name, uint64 object_size, uint64 count, void (*ctor)(void *));
 void *kalloc(struct allocator *alloc);
 void kfree(struct allocator *alloc, void *obj);
+uint64 allocator_available(struct allocator *alloc);
+int64 allocator_shrink_all();
+void allocator_print_stats();
+
+// General-purpose buffers, in power-of-two size classes:
+void kmalloc_init();
+void *kmalloc(uint64 size);
+void kfree_sized(void *p, uint64 size);
 
-#endif // KALLOC_H
\ No newline at end of file
+#endif // KALLOC_H
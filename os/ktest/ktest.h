@@ -4,10 +4,22 @@
 #include "../types.h"
 uint64 ktest_syscall(uint64 args[6]);
 
-#define KTEST_PRINT_USERPGT 1
-#define KTEST_PRINT_KERNPGT 2
-#define KTEST_GET_NRFREEPGS 3
-#define KTEST_GET_NRSTRBUF  4
+#define KTEST_PRINT_USERPGT  1
+#define KTEST_PRINT_KERNPGT  2
+#define KTEST_GET_NRFREEPGS  3
+#define KTEST_GET_NRSTRBUF   4
+#define KTEST_GET_NRFREEBLKS 5  // arg: order
+#define KTEST_PRINT_SCHED    6
+#define KTEST_QUEUE_INIT     7  // arg: 1 for the spinlock baseline
+#define KTEST_QUEUE_STRESS   8  // arg: rounds, returns the time taken in us
+#define KTEST_QUEUE_CHECK    9
+#define KTEST_WAKEUP         10  // args: rounds, 1 for the pool scan baseline, returns the time taken in ns
+#define KTEST_RECLAIM        11  // give back all the memory this cpu caches, before KTEST_GET_NRFREEPGS
+
+void ktest_queue_init(int locked);
+uint64 ktest_queue_stress(int pid, uint64 n);
+int ktest_queue_check();
+uint64 ktest_wakeup(uint64 n, int scan);
 
 #define KTEST_A3_COPY_TO_USER 99
 
@@ -0,0 +1,103 @@
+#include "defs.h"
+#include "ktest.h"
+#include "queue.h"
+
+// Stress test and throughput comparison of struct queue, driven by user processes running concurrently on all harts.
+// Each process pushes a batch of unique values, then pops as many (not necessarily its own),
+//  and sums what it pushed and popped. Once all are done, the queue must be empty and the sums equal.
+
+#define BATCH 8
+
+// the spinlock queue that struct queue replaced, as the baseline.
+struct locked_queue {
+    spinlock_t lock;
+    void *data[QUEUE_SIZE];
+    int front;
+    int size;
+};
+
+static void locked_push(struct locked_queue *q, void *data) {
+    acquire(&q->lock);
+    if (q->size == QUEUE_SIZE)
+        panic("queue overflow");
+    q->data[(q->front + q->size) % QUEUE_SIZE] = data;
+    q->size++;
+    release(&q->lock);
+}
+
+static void *locked_pop(struct locked_queue *q) {
+    void *data = NULL;
+    acquire(&q->lock);
+    if (q->size > 0) {
+        data     = q->data[q->front];
+        q->front = (q->front + 1) % QUEUE_SIZE;
+        q->size--;
+    }
+    release(&q->lock);
+    return data;
+}
+
+static struct {
+    int locked;  // use the baseline
+    struct queue q;
+    struct locked_queue lq;
+    uint64 push_sum, pop_sum;
+    uint64 push_cnt, pop_cnt;
+} qt;
+
+void ktest_queue_init(int locked) {
+    qt.locked = locked;
+    init_queue(&qt.q);
+    spinlock_init(&qt.lq.lock, "ktest-queue");
+    qt.lq.front = qt.lq.size = 0;
+    qt.push_sum = qt.pop_sum = 0;
+    qt.push_cnt = qt.pop_cnt = 0;
+    MEMORY_FENCE();
+}
+
+// Run n rounds, return the time taken in r_time() units.
+uint64 ktest_queue_stress(int pid, uint64 n) {
+    uint64 push_sum = 0, pop_sum = 0, pop_cnt = 0;
+    uint64 t0 = r_time();
+
+    for (uint64 i = 0; i < n; i++) {
+        for (int j = 0; j < BATCH; j++) {
+            uint64 v = ((uint64)pid << 32) | (i * BATCH + j + 1);
+            if (qt.locked)
+                locked_push(&qt.lq, (void *)v);
+            else if (push_queue(&qt.q, (void *)v) < 0)
+                panic("ktest queue: full");
+            push_sum += v;
+        }
+        // a pop may find the queue momentarily empty while a concurrent push is in flight: retry.
+        for (int j = 0; j < BATCH; j++) {
+            uint64 v;
+            do {
+                v = (uint64)(qt.locked ? locked_pop(&qt.lq) : pop_queue(&qt.q));
+            } while (v == 0);
+            pop_sum += v;
+            pop_cnt++;
+        }
+    }
+
+    uint64 t1 = r_time();
+    __sync_fetch_and_add(&qt.push_sum, push_sum);
+    __sync_fetch_and_add(&qt.pop_sum, pop_sum);
+    __sync_fetch_and_add(&qt.push_cnt, n * BATCH);
+    __sync_fetch_and_add(&qt.pop_cnt, pop_cnt);
+    return t1 - t0;
+}
+
+// Return 0 if every pushed value was popped exactly once (as far as sums can tell).
+int ktest_queue_check() {
+    void *left = qt.locked ? locked_pop(&qt.lq) : pop_queue(&qt.q);
+    if (left != NULL) {
+        errorf("ktest queue: not empty");
+        return -1;
+    }
+    if (qt.push_cnt != qt.pop_cnt || qt.push_sum != qt.pop_sum) {
+        errorf("ktest queue: pushed %d, popped %d", (int)qt.push_cnt, (int)qt.pop_cnt);
+        return -1;
+    }
+    return 0;
+}
@@ -1,7 +1,8 @@
+#include "debug.h"
 #include "defs.h"
 #include "ktest.h"
+#include "timer.h"
 
-extern int64 freepages_count;
 extern allocator_t kstrbuf;
 
 void assignment3_copytouser(uint64 useraddr, uint64 uservalue) {
@@ -22,9 +23,26 @@ uint64 ktest_syscall(uint64 args[6]) {
             vm_print(kernel_pagetable);
             break;
         case KTEST_GET_NRFREEPGS:
-            return freepages_count;
+            return kpgmgr_nr_free();
+        case KTEST_RECLAIM:
+            kpgmgr_reclaim_all();
+            return 0;
         case KTEST_GET_NRSTRBUF:
-            return kstrbuf.available_count;
+            return allocator_available(&kstrbuf);
+        case KTEST_GET_NRFREEBLKS:
+            return kpgmgr_nr_free_blocks(args[1]);
+        case KTEST_PRINT_SCHED:
+            print_sched();
+            break;
+        case KTEST_QUEUE_INIT:
+            ktest_queue_init(args[1]);
+            return 0;
+        case KTEST_QUEUE_STRESS:
+            return ktest_queue_stress(curr_proc()->pid, args[1]) * 1000000 / CPU_FREQ;
+        case KTEST_QUEUE_CHECK:
+            return ktest_queue_check();
+        case KTEST_WAKEUP:
+            return ktest_wakeup(args[1], args[2]) * (1000000000 / CPU_FREQ);
         case KTEST_A3_COPY_TO_USER:
             assignment3_copytouser(args[1], args[2]);
             return 0;
@@ -0,0 +1,36 @@
+#include "defs.h"
+#include "ktest.h"
+#include "timer.h"
+#include "trap.h"
+
+// Cost of the wakeup of a timer tick with processes in sleep(), none of them due yet,
+//  against the scan of the whole pool that the wait queue sorted by deadline replaced.
+
+extern struct proc *pool[NPROC];
+
+// the timer tick before wait queues, as the baseline: visit every process to find the due ones.
+static void wakeup_scan(uint64 now) {
+    for (int i = 0; i < NPROC; i++) {
+        struct proc *p = pool[i];
+        acquire(&p->lock);
+        if (p->state == SLEEPING && p->sleep_chan == &ticks_wq && p->wq_key <= now) {
+            p->state = RUNNABLE;
+            add_task(p);
+        }
+        release(&p->lock);
+    }
+}
+
+// Do n wakeups, return the time taken in r_time() units.
+uint64 ktest_wakeup(uint64 n, int scan) {
+    uint64 t0 = r_time();
+    for (uint64 i = 0; i < n; i++) {
+        acquire(&tickslock);
+        if (scan)
+            wakeup_scan(get_ticks());
+        else
+            next_deadline = wake_up_to(&ticks_wq, get_ticks());
+        release(&tickslock);
+    }
+    return r_time() - t0;
+}
@@ -32,6 +32,7 @@ static uint64 __kva allockernelpage() {
         void *__pa pa = kallocpage();
         if (pa == 0)
             panic("out of memory");
+        page_set_type((uint64)pa, PAGE_PGTABLE);
         return PA_TO_KVA(pa);
     }
     return allocsetuppage();
@@ -141,7 +142,7 @@ static pagetable_t kvmmake() {
 }
 
 // Add a mapping to the kernel page table.
-// only used when booting.
+// only used when booting, or on ranges prepared by kvmreserve().
 void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm) {
     assert(PGALIGNED(va));
     assert(PGALIGNED(pa));
@@ -208,4 +209,50 @@ void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm) {
     }
     assert(vaddr == vaddr_end);
     assert(sz == 0);
-}
\ No newline at end of file
+}
+
+// Return the address of the level-0 PTE for va in the kernel page table.
+// If alloc != 0, create any required page-table pages.
+static pte_t *kvmwalk(pagetable_t kpgtbl, uint64 va, int alloc) {
+    pagetable_t pagetable = kpgtbl;
+    for (int level = 2; level > 0; level--) {
+        pte_t *pte = &pagetable[PX(level, va)];
+        if (*pte & PTE_V) {
+            if (*pte & PTE_RWX)
+                panic("kvmwalk: vaddr %p is mapped by a huge page at level %d", va, level);
+            pagetable = (pagetable_t)PA_TO_KVA(PTE2PA(*pte));
+        } else {
+            if (!alloc)
+                return NULL;
+            uint64 __kva newpg = allockernelpage();
+            memset((void *)newpg, 0, PGSIZE);
+            *pte      = MAKE_PTE(KVA_TO_PA(newpg), 0);
+            pagetable = (pagetable_t)newpg;
+        }
+    }
+    return &pagetable[PX(0, va)];
+}
+
+// Create the page-table pages for [va, va + sz) in advance.
+// kvmmap() of 4 KiB pages in the range then only writes level-0 PTEs,
+//  and can be used after booting, concurrently on different pages.
+void kvmreserve(pagetable_t kpgtbl, uint64 va, uint64 sz) {
+    assert(PGALIGNED(va));
+    assert(PGALIGNED(sz));
+
+    for (uint64 a = va; a < va + sz; a = ROUNDUP_2N(a + 1, PGSIZE_2M)) kvmwalk(kpgtbl, a, 1);
+}
+
+// Remove the 4 KiB mappings of [va, va + sz). Page-table pages are kept.
+// The caller is responsible for flushing the TLBs of all harts.
+void kvmunmap(pagetable_t kpgtbl, uint64 va, uint64 sz) {
+    assert(PGALIGNED(va));
+    assert(PGALIGNED(sz));
+
+    for (uint64 a = va; a < va + sz; a += PGSIZE) {
+        pte_t *pte = kvmwalk(kpgtbl, a, 0);
+        if (pte == NULL || !(*pte & PTE_V))
+            panic("kvmunmap: vaddr %p not mapped", a);
+        *pte = 0;
+    }
+}
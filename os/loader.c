@@ -66,11 +66,16 @@ int load_user_elf(struct user_app *app, struct proc *p, char *args[]) {
             pte_perm |= PTE_X;
 
         struct vma *vma = mm_create_vma(new_mm);
+        if (vma == NULL) {
+            ret = -ENOMEM;
+            goto bad;
+        }
         vma->vm_start   = PGROUNDDOWN(phdr->p_vaddr);  // The ELF requests this phdr loaded to p_vaddr;
         vma->vm_end     = PGROUNDUP(vma->vm_start + phdr->p_memsz);
         vma->pte_flags  = pte_perm;
 
         // map the VMA with mm_mappages. if succeed, walkaddr should never fails.
+        // pages are zero-filled, so the remaining bytes and the .bss segment are already cleared.
         if ((ret = mm_mappages(vma)) < 0) {
             errorf("mm_mappages phdr: vaddr %p", phdr->p_vaddr);
             goto bad;
@@ -86,36 +91,20 @@ int load_user_elf(struct user_app *app, struct proc *p, char *args[]) {
             uint64 copy_size = MIN(file_remains, PGSIZE);
             memmove(pa, src, copy_size);
 
-            if (copy_size < PGSIZE) {
-                // clear remaining bytes
-                memset(pa + copy_size, 0, PGSIZE - copy_size);
-            }
             file_off += copy_size;
             file_remains -= copy_size;
         }
 
-        if (phdr->p_memsz > phdr->p_filesz) {
-            // ELF requests larger memory than filesz
-            // 	these are .bss segment, clear it to zero.
-
-            uint64 bss_start = phdr->p_vaddr + phdr->p_filesz;
-            uint64 bss_end   = phdr->p_vaddr + phdr->p_memsz;
-
-            for (uint64 va = bss_start; va < bss_end; va = PGROUNDDOWN(va) + PGSIZE) {
-                // set [va, page boundary of ba) to zero
-                uint64 page_off   = va - PGROUNDDOWN(va);
-                uint64 clear_size = PGROUNDUP(va) - va;
-                void *__kva pa    = (void *)PA_TO_KVA(walkaddr(new_mm, PGROUNDDOWN(va)));
-                memset(pa + page_off, 0, clear_size);
-            }
-        }
-
         assert(file_remains == 0);
         max_va_end = MAX(max_va_end, PGROUNDUP(phdr->p_vaddr + phdr->p_memsz));
     }
 
     // setup brk: zero
-    vma_brk            = mm_create_vma(new_mm);
+    vma_brk = mm_create_vma(new_mm);
+    if (vma_brk == NULL) {
+        ret = -ENOMEM;
+        goto bad;
+    }
     vma_brk->vm_start  = max_va_end;
     vma_brk->vm_end    = max_va_end;
     vma_brk->pte_flags = PTE_R | PTE_W | PTE_U;
@@ -125,8 +114,12 @@ int load_user_elf(struct user_app *app, struct proc *p, char *args[]) {
     }
     brk = max_va_end;
 
-    // setup stack
+    // setup stack, zero-filled by mm_mappages
     struct vma *vma_ustack = mm_create_vma(new_mm);
+    if (vma_ustack == NULL) {
+        ret = -ENOMEM;
+        goto bad;
+    }
     vma_ustack->vm_start   = USTACK_START - USTACK_SIZE;
     vma_ustack->vm_end     = USTACK_START;
     vma_ustack->pte_flags  = PTE_R | PTE_W | PTE_U;
@@ -135,11 +128,6 @@ int load_user_elf(struct user_app *app, struct proc *p, char *args[]) {
         goto bad;
     }
 
-    for (uint64 va = vma_ustack->vm_start; va < vma_ustack->vm_end; va += PGSIZE) {
-        void *__kva pa = (void *)PA_TO_KVA(walkaddr(new_mm, va));
-        memset(pa, 0, PGSIZE);
-    }
-
     // from here, we are done with all page allocation 
     // (including pagetable allocation during mapping the trampoline and trapframe).
 
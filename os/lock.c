@@ -37,6 +37,23 @@ void acquire(spinlock_t *lk)
 	lk->where = (void *)ra;
 }
 
+// Acquire the lock only if it is free, without spinning.
+// Return 1 if acquired, 0 if the lock is held by anyone, including this cpu.
+int try_acquire(spinlock_t *lk)
+{
+	uint64 ra = r_ra();
+	push_off();
+	if (holding(lk) || __sync_lock_test_and_set(&lk->locked, 1) != 0) {
+		pop_off();
+		return 0;
+	}
+	__sync_synchronize();
+
+	lk->cpu = mycpu();
+	lk->where = (void *)ra;
+	return 1;
+}
+
 // Release the lock.
 void release(spinlock_t *lk)
 {
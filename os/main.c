@@ -212,6 +212,7 @@ static void bootcpu_init() {
     plicinit();
     kpgmgrinit();
     uvm_init();
+    kmalloc_init();
     proc_init();
     allocator_init(&kstrbuf, "kstrbuf", KSTRING_MAX, 4096);
     loader_init();
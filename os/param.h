@@ -0,0 +1,14 @@
+#ifndef PARAM_H
+#define PARAM_H
+
+// Kernel defines
+#define ENABLE_SMP    (1)
+#define NCPU          (4)
+#ifndef NPROC
+#define NPROC         (512)  // set by `make NPROC=...`
+#endif
+#define KSTRING_MAX   (256)
+#define MAXARG        (32)
+#define PHYS_MEM_SIZE (128ull * 1024 * 1024)
+
+#endif  // PARAM_H
@@ -4,18 +4,120 @@
 #include "kalloc.h"
 #include "loader.h"
 #include "queue.h"
+#include "sbi.h"
+#include "timer.h"
 #include "trap.h"
 
-struct proc *pool[NPROC];
+struct proc *pool[NPROC];  // created at boot, their kernel stack and trapframe on demand, see allocproc()
 struct proc *init_proc = NULL;
+int nr_procs            = 0;  // number of procs not UNUSED
 static allocator_t proc_allocator;
 
-static spinlock_t pid_lock;
-static spinlock_t wait_lock;
+static spinlock_t pid_lock;  // protects the pid counter and the changes of pid_hash
+static spinlock_t wait_lock;  // protects the parent and children links of all processes
+
+// indexes in pool of the UNUSED procs, as a stack, so that allocproc() takes one at once.
+// Slots that were never used are at the bottom: freed ones, with their stack and trapframe, are reused first.
+static spinlock_t free_lock;
+static int free_slots[NPROC];
+static int nr_free_slots;
+static spinlock_t kstack_lock;  // held by shrink_proc_cache() until the TLBs are flushed
+
+// Live processes by pid, chained by proc->pid_next. Read without locks, see find_proc().
+#define PID_HASH_BITS 8
+static struct proc *pid_hash[1 << PID_HASH_BITS];
+static uint64 pid_hash_seq;  // odd while a process is being removed
+
+// wait queues of sleep()/wakeup(), by the hash of the channel.
+#define WAITQ_HASH_BITS 6
+static struct wait_queue waitq_table[1 << WAITQ_HASH_BITS];
 
 extern void sched_init();
 
+static void proc_ctor(void *obj) {
+    struct proc *p = obj;
+    memset(p, 0, sizeof(*p));
+    spinlock_init(&p->lock, "proc");
+    p->state        = UNUSED;
+    p->rq_home.proc = p;
+    p->rq_entry     = &p->rq_home;
+}
+
+// Give p, taken from the free slots, its trapframe and kernel stack.
+// Return -ENOMEM if out of memory.
+static int create_kstack(struct proc *p) {
+    void *__pa tf, *__pa stack[KERNEL_STACK_SIZE / PGSIZE] = {0};
+
+    if ((tf = kallocpage()) == NULL)
+        return -ENOMEM;
+    for (int j = 0; j < KERNEL_STACK_SIZE / PGSIZE; j++) {
+        if ((stack[j] = kallocpage()) == NULL)
+            goto err;
+    }
+
+    // the page-table pages of the stack window are reserved by proc_init(): this cannot fail,
+    //  and only writes the level-0 PTEs of this slot.
+    // Other harts may still cache the translations of a stack freed by shrink_proc_cache(): wait for their flush.
+    acquire(&kstack_lock);
+    for (int j = 0; j < KERNEL_STACK_SIZE / PGSIZE; j++) {
+        kvmmap(kernel_pagetable, p->kstack + j * PGSIZE, (uint64)stack[j], PGSIZE, PTE_A | PTE_D | PTE_R | PTE_W);
+        p->kstack_pages[j] = stack[j];
+    }
+    sfence_vma();
+    release(&kstack_lock);
+    p->trapframe = (struct trapframe *)PA_TO_KVA(tf);
+    return 0;
+
+err:
+    for (int j = 0; j < KERNEL_STACK_SIZE / PGSIZE; j++)
+        if (stack[j])
+            kfreepage(stack[j]);
+    kfreepage(tf);
+    return -ENOMEM;
+}
+
+// Reclaim: free the trapframe and kernel stack of the procs in free slots, allocproc() creates them again.
+// Called by the page allocator with arbitrary locks held: give up if the locks are busy.
+// Returns the number of pages freed.
+int64 shrink_proc_cache() {
+    struct linklist *pages = NULL;
+    int64 nr               = 0;
+
+    if (!try_acquire(&kstack_lock))
+        return 0;
+    if (!try_acquire(&free_lock)) {
+        release(&kstack_lock);
+        return 0;
+    }
+    for (int k = 0; k < nr_free_slots; k++) {
+        struct proc *p = pool[free_slots[k]];
+        if (p->trapframe == NULL)
+            continue;
+        kvmunmap(kernel_pagetable, p->kstack, KERNEL_STACK_SIZE);
+        for (int j = 0; j < KERNEL_STACK_SIZE / PGSIZE; j++) {
+            kpagelist_add(&pages, p->kstack_pages[j]);
+            p->kstack_pages[j] = NULL;
+        }
+        kpagelist_add(&pages, (void *)KVA_TO_PA(p->trapframe));
+        p->trapframe = NULL;
+        nr += 1 + KERNEL_STACK_SIZE / PGSIZE;
+    }
+    release(&free_lock);
+
+    // other harts may still cache the translations of the stacks: flush them before a slot is mapped again.
+    if (nr > 0)
+        sbi_remote_sfence_vma(KERNEL_STACK_PROCS, (uint64)NPROC * 2 * KERNEL_STACK_SIZE);
+    release(&kstack_lock);
+
+    kfreepages_list(pages);
+    if (nr)
+        infof("reclaim: freed the kernel stacks of %d free procs", (int)(nr / (1 + KERNEL_STACK_SIZE / PGSIZE)));
+    return nr;
+}
+
 // initialize the proc table at boot time.
+// Kernel stacks and trapframes are created by allocproc() when needed, and kept for reuse once freed,
+//  until shrink_proc_cache() reclaims them.
 void proc_init() {
     // we only init once.
     static int proc_inited = 0;
@@ -24,36 +126,27 @@ void proc_init() {
 
     spinlock_init(&pid_lock, "pid");
     spinlock_init(&wait_lock, "wait");
+    spinlock_init(&free_lock, "free_procs");
+    for (int i = 0; i < (1 << WAITQ_HASH_BITS); i++) init_waitqueue(&waitq_table[i], "waitq");
 
-    allocator_init(&proc_allocator, "proc", sizeof(struct proc), NPROC);
-    struct proc *p;
-
-    uint64 proc_kstack = KERNEL_STACK_PROCS;
+    // objects cached in magazines count as in use: leave room for them, procs are never freed.
+    allocator_init_ctor(&proc_allocator, "proc", sizeof(struct proc), NPROC + NCPU * ALLOCATOR_MAG_SIZE, proc_ctor);
+    spinlock_init(&kstack_lock, "kstack");
+    kvmreserve(kernel_pagetable, KERNEL_STACK_PROCS, (uint64)NPROC * 2 * KERNEL_STACK_SIZE);
 
+    // the procs themselves are small, and never freed: find_proc() and the run queues read them without locks.
+    // The kernel stack of slot i is always at the same address, below a guard gap.
     for (int i = 0; i < NPROC; i++) {
-        p = kalloc(&proc_allocator);
-        memset(p, 0, sizeof(*p));
-        spinlock_init(&p->lock, "proc");
-        p->index = i;
-        p->state = UNUSED;
-
-        // allocate the Trapframe.
-        uint64 __pa tf = (uint64)kallocpage();
-        // during system boots, we should always have enough memory.
-        assert(tf);
-        p->trapframe = (struct trapframe *)PA_TO_KVA(tf);
-
-        p->kstack = proc_kstack;
-        for (uint64 va = proc_kstack; va < proc_kstack + KERNEL_STACK_SIZE; va += PGSIZE) {
-            uint64 __pa newpg = (uint64)kallocpage();
-            assert(newpg);
-            kvmmap(kernel_pagetable, va, newpg, PGSIZE, PTE_A | PTE_D | PTE_R | PTE_W);
-        }
-        sfence_vma();
-        proc_kstack += 2 * KERNEL_STACK_SIZE;
-
-        pool[i] = p;
+        struct proc *p = kalloc(&proc_allocator);
+        if (p == NULL)
+            panic("proc_init: out of memory");
+        p->index  = i;
+        p->kstack = KERNEL_STACK_PROCS + (uint64)i * 2 * KERNEL_STACK_SIZE;
+        pool[i]   = p;
+        // pool[0] on top.
+        free_slots[NPROC - 1 - i] = i;
     }
+    nr_free_slots = NPROC;
     sched_init();
 }
 
@@ -67,35 +160,120 @@ static int allocpid() {
 
     return retpid;
 }
+static struct proc **pid_chain(int pid) {
+    return &pid_hash[(uint)pid & ((1 << PID_HASH_BITS) - 1)];
+}
+
+static void pid_hash_insert(struct proc *p) {
+    struct proc **head = pid_chain(p->pid);
+
+    acquire(&pid_lock);
+    p->pid_next = *head;
+    __atomic_store_n(head, p, __ATOMIC_RELEASE);
+    release(&pid_lock);
+}
+
+// p->pid_next is left as is: a reader standing on p still reaches the end of the chain.
+// But p may be inserted in another chain before it gets there, so readers that miss retry, see find_proc().
+static void pid_hash_remove(struct proc *p) {
+    struct proc **pp = pid_chain(p->pid);
+
+    acquire(&pid_lock);
+    __sync_fetch_and_add(&pid_hash_seq, 1);
+    while (*pp != p) pp = &(*pp)->pid_next;
+    __atomic_store_n(pp, p->pid_next, __ATOMIC_RELEASE);
+    __sync_fetch_and_add(&pid_hash_seq, 1);
+    release(&pid_lock);
+}
+
+// Return the live process with the given pid, locked, or NULL if there is none.
+// The chain is walked without locks: processes are never freed, only reused, so a stale one is
+//  harmless and the match is checked again under its lock.
+struct proc *find_proc(int pid) {
+    for (;;) {
+        uint64 seq = __atomic_load_n(&pid_hash_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1)
+            continue;
+
+        struct proc *p = __atomic_load_n(pid_chain(pid), __ATOMIC_ACQUIRE);
+        for (; p != NULL; p = __atomic_load_n(&p->pid_next, __ATOMIC_ACQUIRE)) {
+            if (__atomic_load_n(&p->pid, __ATOMIC_RELAXED) != pid)
+                continue;
+            acquire(&p->lock);
+            if (p->pid == pid && p->state != UNUSED)
+                return p;
+            release(&p->lock);
+        }
+
+        MEMORY_FENCE();
+        if (__atomic_load_n(&pid_hash_seq, __ATOMIC_RELAXED) == seq)
+            return NULL;
+    }
+}
+
 static void first_sched_ret(void) {
+    finish_switch();
     release(&curr_proc()->lock);
     intr_off();
     usertrapret();
 }
 
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc from the free slots, creating its kernel stack and trapframe if it has none.
 // If found, initialize state required to run in the kernel.
 // If there are no free procs, or a memory allocation fails, return 0.
 struct proc *allocproc() {
     struct proc *p;
-    for (int i = 0; i < NPROC; i++) {
-        p = pool[i];
-        acquire(&p->lock);
-        if (p->state == UNUSED) {
-            goto found;
-        }
-        release(&p->lock);
+    int i;
+
+    acquire(&free_lock);
+    if (nr_free_slots == 0) {
+        release(&free_lock);
+        return 0;
     }
-    return 0;
+    i = free_slots[--nr_free_slots];
+    release(&free_lock);
+
+    p = pool[i];
+    if (p->trapframe == NULL && create_kstack(p) < 0) {
+        acquire(&free_lock);
+        free_slots[nr_free_slots++] = i;
+        release(&free_lock);
+        return 0;
+    }
+
+    // freeproc() may still hold the lock.
+    acquire(&p->lock);
+    assert(p->state == UNUSED);
 
-found:
     // initialize a proc
     tracef("init proc %p", p);
-    p->parent     = NULL;
-    p->exit_code  = 0;
-    p->sleep_chan = NULL;
-    p->pid        = allocpid();
+    p->parent       = NULL;
+    p->children     = NULL;
+    p->sibling_next = NULL;
+    p->sibling_prev = NULL;
+    p->exit_code    = 0;
+    p->sleep_chan   = NULL;
+    p->pid          = allocpid();
     p->state      = USED;
+    pid_hash_insert(p);
+    p->last_cpu   = -1;
+    p->rq_cpu     = -1;
+    p->cpumask    = CPUMASK_ALL;
+    p->on_rq      = 0;
+    __sync_fetch_and_add(&nr_procs, 1);
+
+    p->priority         = SCHED_DEFAULT_PRIO;
+    p->base_priority    = SCHED_DEFAULT_PRIO;
+    p->slice_ticks      = 0;
+    p->boost_epoch      = 0;
+    p->vruntime         = 0;
+    p->sum_exec_runtime = 0;
+    p->wakeup_time      = 0;
+    p->queued_time      = 0;
+    p->run_delay        = 0;
+    p->nr_runs          = 0;
+    p->nr_voluntary     = 0;
+    p->nr_involuntary   = 0;
 
     // fork or exec(load_user_elf) will initialize these:
     p->mm      = NULL;
@@ -103,8 +281,8 @@ found:
 
     // prepare trapframe and the first return context.
     memset(&p->context, 0, sizeof(p->context));
-    memset((void *)p->kstack, 0, KERNEL_STACK_SIZE);
-    memset((void *)p->trapframe, 0, PGSIZE);
+    // the stack needs no clearing, the trapframe only where registers are saved.
+    memset((void *)p->trapframe, 0, sizeof(struct trapframe));
     p->context.ra = (uint64)first_sched_ret;
     p->context.sp = p->kstack + KERNEL_STACK_SIZE;
 
@@ -113,12 +291,41 @@ found:
     return p;
 }
 
+// Children lists, protected by wait_lock.
+static void add_child(struct proc *parent, struct proc *child) {
+    assert(holding(&wait_lock));
+    child->parent       = parent;
+    child->sibling_prev = NULL;
+    child->sibling_next = parent->children;
+    if (parent->children)
+        parent->children->sibling_prev = child;
+    parent->children = child;
+}
+
+static void remove_child(struct proc *child) {
+    assert(holding(&wait_lock));
+    struct proc *parent = child->parent;
+    if (child->sibling_prev)
+        child->sibling_prev->sibling_next = child->sibling_next;
+    else
+        parent->children = child->sibling_next;
+    if (child->sibling_next)
+        child->sibling_next->sibling_prev = child->sibling_prev;
+    child->parent       = NULL;
+    child->sibling_next = NULL;
+    child->sibling_prev = NULL;
+}
+
 static void freeproc(struct proc *p) {
     assert(holding(&p->lock));
 
+    pid_hash_remove(p);
+    if (p->parent)
+        remove_child(p);
     p->state      = UNUSED;
     p->pid        = -1;
     p->exit_code  = 0xdeadbeef;
+    __sync_fetch_and_sub(&nr_procs, 1);
     p->sleep_chan = NULL;
     p->killed     = 0;
     p->parent     = NULL;
@@ -131,47 +338,147 @@ static void freeproc(struct proc *p) {
 
     p->mm      = NULL;
     p->vma_brk = NULL;
+
+    acquire(&free_lock);
+    free_slots[nr_free_slots++] = p->index;
+    release(&free_lock);
 }
 
-void sleep(void *chan, spinlock_t *lk) {
+void init_waitqueue(struct wait_queue *wq, char *name) {
+    spinlock_init(&wq->lock, name);
+    wq->head = NULL;
+}
+
+static struct wait_queue *chan_waitq(void *chan) {
+    return &waitq_table[((uint64)chan * 0x9e3779b97f4a7c15ull) >> (64 - WAITQ_HASH_BITS)];
+}
+
+static void waitq_remove(struct wait_queue *wq, struct proc *p) {
+    assert(holding(&wq->lock) && holding(&p->lock));
+    assert(p->wq == wq);
+    if (p->wq_prev)
+        p->wq_prev->wq_next = p->wq_next;
+    else
+        wq->head = p->wq_next;
+    if (p->wq_next)
+        p->wq_next->wq_prev = p->wq_prev;
+    p->wq      = NULL;
+    p->wq_next = NULL;
+    p->wq_prev = NULL;
+}
+
+// Lock order: lk, wq->lock, then p->lock.
+// wq is kept sorted by key, sleepers with the same key in no particular order.
+static void __sleep(struct wait_queue *wq, void *chan, uint64 key, spinlock_t *lk) {
     struct proc *p = curr_proc();
 
+    // Once we are on wq, we can be guaranteed that
+    // we won't miss any wakeup (wakeup locks wq->lock),
+    // so it's okay to release lk.
     // Must acquire p->lock in order to
     // change p->state and then call sched.
-    // Once we hold p->lock, we can be
-    // guaranteed that we won't miss any wakeup
-    // (wakeup locks p->lock),
-    // so it's okay to release lk.
 
+    acquire(&wq->lock);
     acquire(&p->lock);  // DOC: sleeplock1
     release(lk);
 
-    // Go to sleep.
+    // Go to sleep, before the first sleeper with a key no less than ours: at the head when all keys are 0.
+    struct proc *prev = NULL, *next = wq->head;
+    while (next != NULL && next->wq_key < key) {
+        prev = next;
+        next = next->wq_next;
+    }
+    p->wq      = wq;
+    p->wq_key  = key;
+    p->wq_prev = prev;
+    p->wq_next = next;
+    if (next)
+        next->wq_prev = p;
+    if (prev)
+        prev->wq_next = p;
+    else
+        wq->head = p;
+
     p->sleep_chan = chan;
     p->state      = SLEEPING;
+    p->nr_voluntary++;
+    release(&wq->lock);
 
     sched();
 
     // p get waking up, Tidy up.
     p->sleep_chan = 0;
+    int queued    = p->wq != NULL;
+    release(&p->lock);
+
+    // woken up by __setkilled(), which leaves p on wq.
+    if (queued) {
+        acquire(&wq->lock);
+        acquire(&p->lock);
+        if (p->wq == wq)
+            waitq_remove(wq, p);
+        release(&p->lock);
+        release(&wq->lock);
+    }
 
     // Reacquire original lock.
-    release(&p->lock);
     acquire(lk);
 }
 
-// Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
-void wakeup(void *chan) {
-    for (int i = 0; i < NPROC; i++) {
-        struct proc *p = pool[i];
+// Wake up the sleepers on chan with a key up to key, return the smallest key left on wq, -1 if none.
+// Only the sleepers woken up are visited, and the first one left.
+static uint64 __wakeup(struct wait_queue *wq, void *chan, uint64 key) {
+    acquire(&wq->lock);
+    struct proc *p = wq->head;
+    while (p != NULL && p->wq_key <= key) {
+        struct proc *next = p->wq_next;
         acquire(&p->lock);
         if (p->state == SLEEPING && p->sleep_chan == chan) {
+            waitq_remove(wq, p);
             p->state = RUNNABLE;
             add_task(p);
         }
         release(&p->lock);
+        p = next;
     }
+    uint64 left = p != NULL ? p->wq_key : -1;
+    release(&wq->lock);
+    return left;
+}
+
+// Atomically release lock lk and sleep on chan.
+// Reacquires lk when awakened.
+void sleep(void *chan, spinlock_t *lk) {
+    __sleep(chan_waitq(chan), chan, 0, lk);
+}
+
+// Wake up all processes sleeping on chan.
+// Must be called without any p->lock.
+void wakeup(void *chan) {
+    __wakeup(chan_waitq(chan), chan, -1);
+}
+
+// Same as sleep(), on a wait queue of its own.
+void sleep_on(struct wait_queue *wq, spinlock_t *lk) {
+    __sleep(wq, wq, 0, lk);
+}
+
+// Wake up all processes sleeping on wq.
+// Must be called without any p->lock.
+void wake_up(struct wait_queue *wq) {
+    __wakeup(wq, wq, -1);
+}
+
+// Same as sleep_on(), keeping wq sorted by key for wake_up_to().
+void sleep_on_key(struct wait_queue *wq, uint64 key, spinlock_t *lk) {
+    __sleep(wq, wq, key, lk);
+}
+
+// Wake up the processes sleeping on wq with a key up to key, visiting only them.
+// Return the smallest key still sleeping, -1 if none.
+// Must be called without any p->lock.
+uint64 wake_up_to(struct wait_queue *wq, uint64 key) {
+    return __wakeup(wq, wq, key);
 }
 
 int fork() {
@@ -209,13 +516,25 @@ int fork() {
 
     // Cause fork to return 0 in the child.
     np->trapframe->a0 = 0;
-    np->parent        = p;
-    np->state         = RUNNABLE;
-    add_task(np);
+    np->base_priority = p->base_priority;
+    np->priority      = p->base_priority;
+    np->vruntime      = p->vruntime;
+    np->cpumask       = p->cpumask;
+    int pid           = np->pid;
     release(&np->lock);
     release(&p->lock);
 
-    return np->pid;
+    // wait_lock comes before any p->lock.
+    acquire(&wait_lock);
+    add_child(p, np);
+    release(&wait_lock);
+
+    acquire(&np->lock);
+    np->state = RUNNABLE;
+    add_task(np);
+    release(&np->lock);
+
+    return pid;
 
 err_free:
     release(&np->mm->lock);
@@ -254,6 +573,16 @@ int exec(char *name, char *args[]) {
     return p->trapframe->a0;
 }
 
+// Free the ZOMBIE child, locked, and return its pid.
+static int reap(struct proc *child, int *code) {
+    int cpid = child->pid;
+    if (code)
+        *code = child->exit_code;
+    freeproc(child);
+    release(&child->lock);
+    return cpid;
+}
+
 int wait(int pid, int *code) {
     struct proc *child;
     int havekids;
@@ -262,28 +591,34 @@ int wait(int pid, int *code) {
     acquire(&wait_lock);
 
     for (;;) {
-        // Scan through table looking for exited children.
         havekids = 0;
-        for (int i = 0; i < NPROC; i++) {
-            child = pool[i];
-            if (child == p)
-                continue;
-
-            acquire(&child->lock);
-            if (child->parent == p) {
-                havekids = 1;
-                if (child->state == ZOMBIE && (pid <= 0 || child->pid == pid)) {
-                    int cpid = child->pid;
+        if (pid > 0) {
+            // a given child: look it up.
+            child = find_proc(pid);
+            if (child != NULL) {
+                if (child->parent == p) {
+                    havekids = 1;
+                    if (child->state == ZOMBIE) {
+                        int cpid = reap(child, code);
+                        release(&wait_lock);
+                        return cpid;
+                    }
+                }
+                release(&child->lock);
+            }
+        } else {
+            // Scan through our children looking for exited ones.
+            havekids = p->children != NULL;
+            for (child = p->children; child != NULL; child = child->sibling_next) {
+                acquire(&child->lock);
+                if (child->state == ZOMBIE) {
                     // Found one.
-                    if (code)
-                        *code = child->exit_code;
-                    freeproc(child);
-                    release(&child->lock);
+                    int cpid = reap(child, code);
                     release(&wait_lock);
                     return cpid;
                 }
+                release(&child->lock);
             }
-            release(&child->lock);
         }
 
         // No waiting if we don't have any children.
@@ -308,23 +643,23 @@ void exit(int code) {
 
     acquire(&wait_lock);
 
-    int wakeinit = 0;
-
-    // reparent:
-    for (int i = 0; i < NPROC; i++) {
-        struct proc *child = pool[i];
-        if (child == p)
-            continue;
-        acquire(&child->lock);
-        if (child->parent == p) {
-            child->parent = init_proc;
-            wakeinit      = 1;
-            // if child has dead, wake up init to do clean up.
+    // reparent: splice our children in front of init's.
+    if (p->children != NULL) {
+        struct proc *last = p->children;
+        for (;;) {
+            last->parent = init_proc;
+            if (last->sibling_next == NULL)
+                break;
+            last = last->sibling_next;
         }
-        release(&child->lock);
-    }
-    if (wakeinit)
+        last->sibling_next = init_proc->children;
+        if (init_proc->children)
+            init_proc->children->sibling_prev = last;
+        init_proc->children = p->children;
+        p->children         = NULL;
+        // if a child has dead, wake up init to do clean up.
         wakeup(init_proc);
+    }
 
     // wakeup wait-ing parent.
     //  There is no race because locking against "wait_lock"
@@ -341,37 +676,197 @@ void exit(int code) {
     panic_never_reach();
 }
 
+static void __setkilled(struct proc *p, int reason) {
+    assert(holding(&p->lock));
+    p->killed = reason;
+    if (p->state == SLEEPING) {
+        // Wake process from sleep(), it takes itself off its wait queue.
+        p->state = RUNNABLE;
+        add_task(p);
+    }
+}
+
 // Kill the process with the given pid.
 // The victim won't exit until it tries to return
 // to user space (see usertrap() in trap.c).
 int kill(int pid) {
-    struct proc *p;
+    struct proc *p = find_proc(pid);
+    if (p == NULL)
+        return -EINVAL;
 
-    for (int i = 0; i < NPROC; i++) {
-        p = pool[i];
-        acquire(&p->lock);
-        if (p->pid == pid) {
-            p->killed = -1;
-            if (p->state == SLEEPING) {
-                // Wake process from sleep().
-                p->state = RUNNABLE;
-                add_task(p);
-            }
-            release(&p->lock);
-            return 0;
-        }
+    __setkilled(p, -1);
+    release(&p->lock);
+    return 0;
+}
+
+// Set the base priority of the process with the given pid, or of the caller if pid is 0.
+// The process restarts at this level, and goes back to it on every priority boost.
+int setpriority(int pid, int prio) {
+    if (prio < 0 || prio >= SCHED_NR_PRIO)
+        return -EINVAL;
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = find_proc(pid);
+    if (p == NULL)
+        return -EINVAL;
+
+    p->base_priority = prio;
+    p->priority      = prio;
+    p->slice_ticks   = 0;
+    release(&p->lock);
+    return 0;
+}
+
+// Restrict the process with the given pid, or the caller if pid is 0, to the cpus in mask.
+// The scheduler moves it at its next pick if it is queued or running elsewhere.
+int sched_setaffinity(int pid, uint64 mask) {
+    mask &= CPUMASK_ALL;
+    if ((mask & online_mask) == 0)
+        return -EINVAL;
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = find_proc(pid);
+    if (p == NULL)
+        return -EINVAL;
+
+    p->cpumask = mask;
+    release(&p->lock);
+    return 0;
+}
+
+// Return the cpu mask of the process with the given pid, or of the caller if pid is 0.
+int64 sched_getaffinity(int pid) {
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = find_proc(pid);
+    if (p == NULL)
+        return -EINVAL;
+
+    int64 mask = p->cpumask;
+    release(&p->lock);
+    return mask;
+}
+
+// Fill st with the scheduler statistics of the process with the given pid, or of the caller if pid is 0.
+int get_schedstat(int pid, struct schedstat *st) {
+    if (pid == 0)
+        pid = curr_proc()->pid;
+
+    struct proc *p = find_proc(pid);
+    if (p == NULL)
+        return -EINVAL;
+
+    st->run_time       = p->sum_exec_runtime * 1000000 / CPU_FREQ;
+    st->wait_time      = p->run_delay * 1000000 / CPU_FREQ;
+    st->nr_runs        = p->nr_runs;
+    st->nr_voluntary   = p->nr_voluntary;
+    st->nr_involuntary = p->nr_involuntary;
+    release(&p->lock);
+    return 0;
+}
+
+// Hand the cpu over to the process with the given pid, for a producer/consumer handoff:
+//  if it is RUNNABLE and may run on this cpu, switch to it at once, without waiting for its turn.
+// The caller is queued back as by yield().
+// Return 0, or -EINVAL if there is no such process to switch to.
+int yield_to(int pid) {
+    struct proc *p = curr_proc();
+    struct proc *t = find_proc(pid);
+
+    if (t == NULL)
+        return -EINVAL;
+    int runnable = t != p && t->state == RUNNABLE;
+    release(&t->lock);
+    if (!runnable)
+        return -EINVAL;
+
+    // t may have started running since: waiting for its lock while holding ours could then deadlock
+    // with it yielding to us, so only try it. t may also have changed meanwhile.
+    acquire(&p->lock);
+    if (!try_acquire(&t->lock)) {
+        release(&p->lock);
+        return -EINVAL;
+    }
+    if (t->pid != pid || t->state != RUNNABLE || !(t->cpumask & (1ull << mycpu()->cpuid))) {
+        release(&t->lock);
         release(&p->lock);
+        return -EINVAL;
     }
-    return -EINVAL;
+
+    int ret = sched_to(t);
+    release(&p->lock);
+    return ret;
 }
 
 void setkilled(struct proc *p, int reason) {
     assert(reason < 0);
     acquire(&p->lock);
-    p->killed = reason;
+    __setkilled(p, reason);
     release(&p->lock);
 }
 
+// Reclaim: free the mm of ZOMBIE processes, without waiting for their parents.
+//  wait() only needs the exit code, and freeproc() handles p->mm == NULL.
+// Called by the page allocator with arbitrary locks held: skip the procs we cannot lock.
+// Return the number of mm freed.
+int reap_zombie_mms() {
+    int nr = 0;
+
+    for (int i = 0; i < NPROC; i++) {
+        struct proc *p = pool[i];
+        if (p->state != ZOMBIE || p->mm == NULL)
+            continue;
+        if (!try_acquire(&p->lock))
+            continue;
+        if (p->state == ZOMBIE && p->mm && try_acquire(&p->mm->lock)) {
+            mm_free(p->mm);
+            p->mm      = NULL;
+            p->vma_brk = NULL;
+            nr++;
+        }
+        release(&p->lock);
+    }
+    if (nr)
+        infof("reclaim: freed the memory of %d zombies", nr);
+    return nr;
+}
+
+// OOM killer: kill the live process with the largest resident set, except init.
+// Called by the page allocator with arbitrary locks held: skip the procs we cannot lock.
+// The lock of the best candidate so far is kept, so that it cannot exit under us.
+// Return the pid of the victim, or -1 if there is none.
+int oom_kill() {
+    struct proc *victim = NULL;
+
+    for (int i = 0; i < NPROC; i++) {
+        struct proc *p = pool[i];
+        if (p == init_proc || p->state == UNUSED || p->state == ZOMBIE)
+            continue;
+        if (!try_acquire(&p->lock))
+            continue;
+        if (p->mm && !p->killed && p->state != ZOMBIE && (!victim || p->mm->rss > victim->mm->rss)) {
+            if (victim)
+                release(&victim->lock);
+            victim = p;
+        } else {
+            release(&p->lock);
+        }
+    }
+    if (victim == NULL) {
+        errorf("out of memory, and no process to kill");
+        return -1;
+    }
+
+    int pid = victim->pid;
+    warnf("out of memory: kill pid %d, rss %d pages", pid, (int)victim->mm->rss);
+    __setkilled(victim, -ENOMEM);
+    release(&victim->lock);
+    return pid;
+}
+
 int iskilled(struct proc *p) {
     int k;
 
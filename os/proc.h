@@ -1,7 +1,10 @@
 #ifndef PROC_H
 #define PROC_H
 
+#include "memlayout.h"
+#include "param.h"
 #include "queue.h"
+#include "rbtree.h"
 #include "riscv.h"
 #include "vm.h"
 
@@ -31,6 +34,23 @@ struct context {
     uint64 s11;
 };
 
+// Scheduling policy, selected by `make SCHED=...`:
+//  - mlfq: multi-level feedback queue, level 0 is the highest priority.
+//  - fifo: a single level, round-robin on every tick.
+//  - cfs:  fair share by virtual runtime, the priority selects the weight, 0 is the heaviest.
+#if defined(SCHED_CFS)
+#define SCHED_NR_PRIO      5
+#define SCHED_DEFAULT_PRIO 2
+#elif defined(SCHED_FIFO)
+#define SCHED_NR_PRIO      1
+#define SCHED_DEFAULT_PRIO 0
+#else
+#define SCHED_NR_PRIO      3
+#define SCHED_DEFAULT_PRIO 0
+#endif
+
+#define CPUMASK_ALL ((1ull << NCPU) - 1)
+
 struct cpu {
     int mhart_id;                  // mhartid for this cpu, passed by OpenSBI
     struct proc *proc;             // current process
@@ -40,10 +60,59 @@ struct cpu {
     int interrupt_on;              // Is the interrupt Enabled before the first push-off?
     uint64 sched_kstack_top;       // top of per-cpu sheduler kernel stack
     int cpuid;                     // for debug purpose
+
+#ifdef SCHED_CFS
+    spinlock_t runq_lock;  // protects the fields below, and the queued processes' rb, vruntime and weight
+    struct rb_root runq;   // RUNNABLE processes queued on this cpu, ordered by vruntime
+    int nr_queued;         // number of processes in runq
+    uint64 runq_weight;    // sum of the weights of the processes in runq
+    uint64 min_vruntime;   // never decreases, the base of vruntime on this cpu
+#else
+    struct queue runq[SCHED_NR_PRIO];  // RUNNABLE processes queued on this cpu, one queue per level
+    uint64 boost_epoch;                // last priority boost applied to runq
+#endif
+    uint64 nr_local;   // tasks fetched from our own runq
+    uint64 nr_steal;   // tasks stolen from another cpu's runq
+    uint64 idle_time;           // time spent in wfi, in r_time() units
+    uint64 nr_switches;         // switches to a process
+    uint64 nr_direct;           // of which from another process, without the scheduler context
+    struct proc *prev;          // process switched away from, unlocked by finish_switch()
+    int ipi_pending;            // an IPI is sent to this cpu, and not handled yet
+    uint64 nr_ipi;              // IPIs sent to this cpu
+    uint64 nr_wakeups;          // woken up tasks run on this cpu
+    uint64 wakeup_latency;      // sum of their time from add_task() to running, in r_time() units
+    uint64 wakeup_latency_max;  // and the max of it
 };
 
+#ifndef SCHED_CFS
+// a queued process holds one entry in the run queues of all cpus, which must never overflow.
+_Static_assert(NPROC <= QUEUE_SIZE, "a run queue must hold all processes");
+#endif
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// Scheduler statistics of a process, as returned to the user by sys_schedstat.
+// Times are in microseconds.
+struct schedstat {
+    uint64 run_time;        // time running on a cpu
+    uint64 wait_time;       // time waiting in a run queue
+    uint64 nr_runs;         // times switched to
+    uint64 nr_voluntary;    // switches by sleep() or yield()
+    uint64 nr_involuntary;  // switches by preemption
+};
+
+// Processes sleeping on a channel, so that a wakeup visits only them.
+// sleep_on()/wake_up() take an explicit one, sleep()/wakeup() on any address share a hashed table of them.
+struct wait_queue {
+    spinlock_t lock;
+    struct proc *head;  // sleeping processes, linked by proc->wq_next
+};
+
+// What a run queue holds for a queued process, see runq_handoff().
+struct runq_entry {
+    struct proc *proc;  // the process holding the entry
+};
+
 // Per-process state
 struct proc {
     spinlock_t lock;
@@ -52,17 +121,51 @@ struct proc {
     int pid;               // Process ID
     int exit_code;
     void *sleep_chan;
+    struct wait_queue *wq;  // wait queue it is on while sleeping, changed with both wq->lock and lock held
+    struct proc *wq_next;   // links in wq
+    struct proc *wq_prev;
+    uint64 wq_key;          // order in wq, see sleep_on_key()
     int killed;
 
-    struct proc *parent;  // Parent process
+    // wait_lock must be held when accessing to these fields:
+    struct proc *parent;        // Parent process
+    struct proc *children;      // first child, the others follow by sibling_next
+    struct proc *sibling_next;  // links in parent->children
+    struct proc *sibling_prev;
+
+    struct proc *pid_next;  // next in the pid hash chain, see find_proc()
+
+    struct runq_entry *rq_entry;  // mlfq: the entry it holds in the run queues, see runq_handoff()
+    struct runq_entry rq_home;    // mlfq: an entry, held by this process or the one it was handed to
 
     int index;
+    int last_cpu;             // cpu this process last ran on, -1 if it never ran
+    int on_rq;                // queued: in the rbtree of rq_cpu (cfs), its rq_entry in a run queue (mlfq)
+    int rq_cpu;               // cfs: cpu whose run queue it is in, and the base of vruntime. -1 if never queued
+    uint64 cpumask;           // cpus it may run on, bit i for cpuid i
+    int priority;             // current level of the run queue
+    int base_priority;        // level to start from, set by setpriority()
+    int slice_ticks;          // ticks used at the current level
+    uint64 boost_epoch;       // last priority boost applied to this process
+    struct rb_node rb;        // node in the cfs run queue
+    uint64 vruntime;          // cfs virtual runtime
+    uint64 weight;            // cfs weight, from base_priority
+    uint64 exec_start;        // r_time() when it was last switched to
+    uint64 wakeup_time;       // r_time() when it was woken up, 0 once it runs
+    uint64 sum_exec_runtime;  // total time running, in r_time() units
+    uint64 queued_time;       // r_time() when it was last queued
+    uint64 run_delay;         // total time RUNNABLE in a run queue, in r_time() units
+    uint64 nr_runs;           // times it was switched to
+    uint64 nr_voluntary;      // switches by sleep() or yield()
+    uint64 nr_involuntary;    // switches by preemption on a timer tick
     struct mm *mm;
     struct vma *vma_brk;                // special vma for heap, included in mm->vma list.
     uint64 brk;                         // end address of heap
     struct trapframe *__kva trapframe;  // data page for trampoline.S
     uint64 __kva kstack;                // Virtual address of kernel stack
     struct context context;             // swtch() here to run process
+
+    void *__pa kstack_pages[KERNEL_STACK_SIZE / PGSIZE];  // mapped at kstack, while trapframe is not NULL
 };
 
 static inline int cpuid() {
@@ -82,6 +185,7 @@ static inline struct proc *curr_proc() {
 }
 
 // proc.c
+extern int nr_procs;
 void proc_init();
 struct proc *allocproc();
 int fork();
@@ -89,17 +193,37 @@ int exec(char *name, char *arg[]);
 int wait(int, int *);
 void exit(int);
 int kill(int pid);
+struct proc *find_proc(int pid);
 int iskilled(struct proc *);
 void setkilled(struct proc *, int reason);
+int setpriority(int pid, int prio);
+int sched_setaffinity(int pid, uint64 mask);
+int64 sched_getaffinity(int pid);
+int get_schedstat(int pid, struct schedstat *st);
+int yield_to(int pid);
+int reap_zombie_mms();
+int64 shrink_proc_cache();
+int oom_kill();
 
 void sleep(void *chan, spinlock_t *lk);
 void wakeup(void *chan);
+void init_waitqueue(struct wait_queue *wq, char *name);
+void sleep_on(struct wait_queue *wq, spinlock_t *lk);
+void wake_up(struct wait_queue *wq);
+void sleep_on_key(struct wait_queue *wq, uint64 key, spinlock_t *lk);
+uint64 wake_up_to(struct wait_queue *wq, uint64 key);
 
 // sched.c
+extern uint64 online_mask;
 void scheduler() __attribute__((noreturn));
 void sched();
+int sched_to(struct proc *);
+void finish_switch();
 void yield();
+void preempt();
 void add_task(struct proc *);
+int sched_tick();
+void sched_ipi();
 
 // swtch.S
 void swtch(struct context *, struct context *);
@@ -1,37 +1,89 @@
 #include "queue.h"
 
 #include "defs.h"
-#include "log.h"
-#include "proc.h"
+
+// Dmitry Vyukov's bounded MPMC queue.
+// Slot i of lap k (position pos = k * QUEUE_SIZE + i) is:
+//  - free for the producer of pos,   when seq == pos,
+//  - full for the consumer of pos,   when seq == pos + 1.
+// The consumer sets seq = pos + QUEUE_SIZE, freeing the slot for the producer of the next lap.
+// The __sync builtins compile to AMOs and LR/SC on RISC-V, and are full fences.
 
 void init_queue(struct queue *q) {
-    spinlock_init(&q->lock, "queue");
-    q->front = q->tail = 0;
-    q->empty           = 1;
+    q->head = q->tail = 0;
+    for (int i = 0; i < QUEUE_SIZE; i++) {
+        q->slots[i].seq  = i;
+        q->slots[i].data = NULL;
+    }
+    MEMORY_FENCE();
 }
 
-void push_queue(struct queue *q, void *data) {
-    acquire(&q->lock);
-    if (!q->empty && q->front == q->tail) {
-        panic("queue overflow");
+// Return 0, or -1 if the queue is full.
+int push_queue(struct queue *q, void *data) {
+    struct queue_slot *slot;
+    uint64 pos = q->tail;
+
+    for (;;) {
+        slot       = &q->slots[pos & (QUEUE_SIZE - 1)];
+        uint64 seq = slot->seq;
+        int64 diff = (int64)(seq - pos);
+        MEMORY_FENCE();  // read seq before the slot
+        if (diff == 0) {
+            // the slot is free: claim position pos.
+            uint64 old = __sync_val_compare_and_swap(&q->tail, pos, pos + 1);
+            if (old == pos)
+                break;
+            pos = old;
+        } else if (diff < 0) {
+            // the consumer of the previous lap has not freed it yet: full.
+            return -1;
+        } else {
+            // another producer has taken pos.
+            pos = q->tail;
+        }
     }
-    q->empty         = 0;
-    q->data[q->tail] = data;
-    q->tail          = (q->tail + 1) % NPROC;
-    release(&q->lock);
+
+    slot->data = data;
+    MEMORY_FENCE();  // publish data before seq
+    slot->seq = pos + 1;
+    return 0;
 }
 
-void *pop_queue(struct queue *q) {
-    acquire(&q->lock);
-    if (q->empty) {
-        release(&q->lock);
-        return NULL;
+// Pop the first element, only if match(data, arg) is true, or always if match is NULL.
+void *pop_queue_if(struct queue *q, int (*match)(void *data, void *arg), void *arg) {
+    struct queue_slot *slot;
+    void *data;
+    uint64 pos = q->head;
+
+    for (;;) {
+        slot       = &q->slots[pos & (QUEUE_SIZE - 1)];
+        uint64 seq = slot->seq;
+        int64 diff = (int64)(seq - (pos + 1));
+        MEMORY_FENCE();  // read seq before the data
+        if (diff == 0) {
+            // the slot is full. data stays valid until position pos is claimed by someone:
+            //  then the CAS below fails.
+            data = slot->data;
+            if (match && !match(data, arg))
+                return NULL;
+            uint64 old = __sync_val_compare_and_swap(&q->head, pos, pos + 1);
+            if (old == pos)
+                break;
+            pos = old;
+        } else if (diff < 0) {
+            // the producer of pos has not filled it yet: empty.
+            return NULL;
+        } else {
+            // another consumer has taken pos.
+            pos = q->head;
+        }
     }
 
-    void *data = q->data[q->front];
-    q->front   = (q->front + 1) % NPROC;
-    if (q->front == q->tail)
-        q->empty = 1;
-    release(&q->lock);
+    MEMORY_FENCE();  // done with the slot before handing it to the producer of the next lap
+    slot->seq = pos + QUEUE_SIZE;
     return data;
 }
+
+void *pop_queue(struct queue *q) {
+    return pop_queue_if(q, NULL, NULL);
+}
@@ -1,20 +1,35 @@
 #ifndef QUEUE_H
 #define QUEUE_H
 
-#include "lock.h"
+#include "types.h"
 
-#define QUEUE_SIZE (1024)
+// Bounded lock-free multi-producer/multi-consumer FIFO of pointers.
+// Each slot carries a sequence number telling whether it is ready for the producer or the consumer of a lap,
+//  so producers and consumers only race on their own position counter, with a CAS.
+// Safe to use from interrupt handlers: it never spins on a lock.
+
+#define QUEUE_SIZE (1024)  // must be a power of 2
+
+struct queue_slot {
+    uint64 seq;
+    void *data;
+};
 
 struct queue {
-    spinlock_t lock;
-    void *data[QUEUE_SIZE];
-    int front;
-    int tail;
-    int empty;
+    uint64 head __attribute__((aligned(64)));  // next position to pop
+    uint64 tail __attribute__((aligned(64)));  // next position to push
+    struct queue_slot slots[QUEUE_SIZE] __attribute__((aligned(64)));
 };
 
 void init_queue(struct queue *);
-void push_queue(struct queue *, void *);
+int push_queue(struct queue *, void *);
 void *pop_queue(struct queue *);
+void *pop_queue_if(struct queue *, int (*match)(void *data, void *arg), void *arg);
+
+// Number of elements, only a hint under concurrent pushes and pops.
+static inline int queue_size(struct queue *q) {
+    int64 size = (int64)(q->tail - q->head);
+    return size < 0 ? 0 : size;
+}
 
 #endif  // QUEUE_H
@@ -0,0 +1,205 @@
+#include "rbtree.h"
+
+// Red-black tree, as in CLRS chapter 13, with NULL as the leaves.
+
+static inline int is_black(struct rb_node *node) {
+    return node == NULL || node->color == RB_BLACK;
+}
+
+// Make the parent of old point to new instead.
+static void replace_child(struct rb_root *root, struct rb_node *old, struct rb_node *new) {
+    struct rb_node *parent = old->parent;
+    if (parent == NULL)
+        root->node = new;
+    else if (parent->left == old)
+        parent->left = new;
+    else
+        parent->right = new;
+    if (new)
+        new->parent = parent;
+}
+
+static void rotate_left(struct rb_root *root, struct rb_node *x) {
+    struct rb_node *y = x->right;
+    x->right          = y->left;
+    if (y->left)
+        y->left->parent = x;
+    replace_child(root, x, y);
+    y->left   = x;
+    x->parent = y;
+}
+
+static void rotate_right(struct rb_root *root, struct rb_node *x) {
+    struct rb_node *y = x->left;
+    x->left           = y->right;
+    if (y->right)
+        y->right->parent = x;
+    replace_child(root, x, y);
+    y->right  = x;
+    x->parent = y;
+}
+
+void rb_insert(struct rb_root *root, struct rb_node *node, int (*less)(struct rb_node *a, struct rb_node *b)) {
+    struct rb_node *parent = NULL, **link = &root->node;
+    while (*link) {
+        parent = *link;
+        link   = less(node, parent) ? &parent->left : &parent->right;
+    }
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->color              = RB_RED;
+    *link                    = node;
+
+    // restore the invariants: a red node has no red child.
+    while ((parent = node->parent) != NULL && parent->color == RB_RED) {
+        // parent is red, so it is not the root and gparent exists.
+        struct rb_node *gparent = parent->parent;
+        if (parent == gparent->left) {
+            struct rb_node *uncle = gparent->right;
+            if (!is_black(uncle)) {
+                uncle->color   = RB_BLACK;
+                parent->color  = RB_BLACK;
+                gparent->color = RB_RED;
+                node           = gparent;
+                continue;
+            }
+            if (node == parent->right) {
+                rotate_left(root, parent);
+                parent = node;
+            }
+            parent->color  = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_right(root, gparent);
+            break;
+        } else {
+            struct rb_node *uncle = gparent->left;
+            if (!is_black(uncle)) {
+                uncle->color   = RB_BLACK;
+                parent->color  = RB_BLACK;
+                gparent->color = RB_RED;
+                node           = gparent;
+                continue;
+            }
+            if (node == parent->left) {
+                rotate_right(root, parent);
+                parent = node;
+            }
+            parent->color  = RB_BLACK;
+            gparent->color = RB_RED;
+            rotate_left(root, gparent);
+            break;
+        }
+    }
+    root->node->color = RB_BLACK;
+}
+
+// x took the place of a removed black node, under parent: it misses one black.
+static void erase_fixup(struct rb_root *root, struct rb_node *x, struct rb_node *parent) {
+    while (x != root->node && is_black(x)) {
+        // x misses one black, so its sibling w is not NULL.
+        if (x == parent->left) {
+            struct rb_node *w = parent->right;
+            if (!is_black(w)) {
+                w->color      = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_left(root, parent);
+                w = parent->right;
+            }
+            if (is_black(w->left) && is_black(w->right)) {
+                w->color = RB_RED;
+                x        = parent;
+                parent   = x->parent;
+            } else {
+                if (is_black(w->right)) {
+                    w->left->color = RB_BLACK;
+                    w->color       = RB_RED;
+                    rotate_right(root, w);
+                    w = parent->right;
+                }
+                w->color        = parent->color;
+                parent->color   = RB_BLACK;
+                w->right->color = RB_BLACK;
+                rotate_left(root, parent);
+                x = root->node;
+            }
+        } else {
+            struct rb_node *w = parent->left;
+            if (!is_black(w)) {
+                w->color      = RB_BLACK;
+                parent->color = RB_RED;
+                rotate_right(root, parent);
+                w = parent->left;
+            }
+            if (is_black(w->left) && is_black(w->right)) {
+                w->color = RB_RED;
+                x        = parent;
+                parent   = x->parent;
+            } else {
+                if (is_black(w->left)) {
+                    w->right->color = RB_BLACK;
+                    w->color        = RB_RED;
+                    rotate_left(root, w);
+                    w = parent->left;
+                }
+                w->color       = parent->color;
+                parent->color  = RB_BLACK;
+                w->left->color = RB_BLACK;
+                rotate_right(root, parent);
+                x = root->node;
+            }
+        }
+    }
+    if (x)
+        x->color = RB_BLACK;
+}
+
+void rb_erase(struct rb_root *root, struct rb_node *node) {
+    struct rb_node *child, *parent;
+    int color;
+
+    if (node->left == NULL || node->right == NULL) {
+        child  = node->left ? node->left : node->right;
+        parent = node->parent;
+        color  = node->color;
+        replace_child(root, node, child);
+    } else {
+        // replace node with its successor y, which has no left child.
+        struct rb_node *y = node->right;
+        while (y->left) y = y->left;
+        child = y->right;
+        color = y->color;
+        if (y->parent == node) {
+            parent = y;
+        } else {
+            parent = y->parent;
+            replace_child(root, y, child);
+            y->right            = node->right;
+            node->right->parent = y;
+        }
+        replace_child(root, node, y);
+        y->left            = node->left;
+        node->left->parent = y;
+        y->color           = node->color;
+    }
+
+    if (color == RB_BLACK)
+        erase_fixup(root, child, parent);
+}
+
+struct rb_node *rb_first(struct rb_root *root) {
+    struct rb_node *node = root->node;
+    if (node == NULL)
+        return NULL;
+    while (node->left) node = node->left;
+    return node;
+}
+
+struct rb_node *rb_next(struct rb_node *node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) node = node->left;
+        return node;
+    }
+    while (node->parent && node == node->parent->right) node = node->parent;
+    return node->parent;
+}
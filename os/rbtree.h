@@ -0,0 +1,32 @@
+#ifndef RBTREE_H
+#define RBTREE_H
+
+#include "types.h"
+
+// Intrusive red-black tree: embed a struct rb_node in the object,
+//  and get the object back with rb_entry().
+// The tree does no locking and no allocation.
+
+enum { RB_RED, RB_BLACK };
+
+struct rb_node {
+    struct rb_node *parent;
+    struct rb_node *left;
+    struct rb_node *right;
+    int color;
+};
+
+struct rb_root {
+    struct rb_node *node;
+};
+
+#define rb_entry(ptr, type, member) ((type *)((char *)(ptr) - __builtin_offsetof(type, member)))
+
+// Insert node into root, ordered by less(a, b).
+// Equal nodes are inserted after the existing ones.
+void rb_insert(struct rb_root *root, struct rb_node *node, int (*less)(struct rb_node *a, struct rb_node *b));
+void rb_erase(struct rb_root *root, struct rb_node *node);
+struct rb_node *rb_first(struct rb_root *root);
+struct rb_node *rb_next(struct rb_node *node);
+
+#endif  // RBTREE_H
@@ -3,53 +3,558 @@
 #include "loader.h"
 #include "proc.h"
 #include "queue.h"
+#include "sbi.h"
+#include "timer.h"
 #include "trap.h"
 
-static struct queue task_queue;
+// Each cpu has its own run queue.
+// A task is queued on the cpu it last ran on, to keep its cache warm,
+//  and a cpu running out of work steals from the busiest cpu.
+//
+// The policy within a cpu is selected at build time, see SCHED_NR_PRIO.
+// Each policy provides the runq_* functions below and sched_tick().
 
-// defined in proc.c
-extern struct proc *pool[NPROC];
+#ifdef SCHED_CFS
+
+// Completely fair scheduling:
+//  - each task accumulates a virtual runtime, its cpu time scaled down by its weight.
+//  - the task with the smallest vruntime runs next, queued tasks are kept in a rbtree ordered by vruntime.
+//  - a task is preempted at a tick, once it has run for its share of CFS_LATENCY,
+//    or when a queued task is well behind it.
+//  - a task waking up is placed at no less than min_vruntime - CFS_SLEEPER_CREDIT:
+//    sleeping earns a small bonus, but not a credit to monopolize the cpu.
+// vruntime is local to a cpu: it is rebased on min_vruntime when a task migrates, see rebase_vruntime().
+
+#define CFS_LATENCY            (CPU_FREQ / 1000 * 20)
+#define CFS_MIN_GRANULARITY    (CPU_FREQ / TICKS_PER_SEC)
+#define CFS_WAKEUP_GRANULARITY (CPU_FREQ / 1000 * 2)
+#define CFS_SLEEPER_CREDIT     (CFS_LATENCY / 2)
+#define CFS_NICE_0_WEIGHT      (1024)
+
+// weight of each priority, as nice -10, -5, 0, 5, 10 in Linux.
+static const uint64 prio_to_weight[SCHED_NR_PRIO] = {9548, 3121, 1024, 335, 110};
+
+static int vruntime_less(struct rb_node *a, struct rb_node *b) {
+    return rb_entry(a, struct proc, rb)->vruntime < rb_entry(b, struct proc, rb)->vruntime;
+}
+
+static void runq_init(struct cpu *c) {
+    spinlock_init(&c->runq_lock, "runq");
+    c->runq.node    = NULL;
+    c->nr_queued    = 0;
+    c->runq_weight  = 0;
+    c->min_vruntime = 0;
+}
+
+static int runq_size(struct cpu *c) {
+    return c->nr_queued;
+}
+
+// Rebase the vruntime of p on the min_vruntime of c, from that of the cpu it is relative to.
+// Done once per move: when p is queued on another cpu, or stolen from the queue of another cpu.
+static void rebase_vruntime(struct cpu *c, struct proc *p) {
+    if (p->rq_cpu >= 0 && p->rq_cpu != c->cpuid) {
+        int64 v     = (int64)c->min_vruntime + (int64)(p->vruntime - getcpu(p->rq_cpu)->min_vruntime);
+        p->vruntime = v < 0 ? 0 : v;
+    }
+    p->rq_cpu = c->cpuid;
+}
+
+static void runq_push(struct cpu *c, struct proc *p) {
+    assert(holding(&p->lock));
+
+    rebase_vruntime(c, p);
+    acquire(&c->runq_lock);
+    uint64 floor = c->min_vruntime > CFS_SLEEPER_CREDIT ? c->min_vruntime - CFS_SLEEPER_CREDIT : 0;
+    if (p->vruntime < floor)
+        p->vruntime = floor;
+    p->weight = prio_to_weight[p->base_priority];
+    p->on_rq  = 1;
+    rb_insert(&c->runq, &p->rb, vruntime_less);
+    c->nr_queued++;
+    c->runq_weight += p->weight;
+    release(&c->runq_lock);
+}
+
+// The fields of a queued task are protected by runq_lock.
+// Return the task locked: once off the tree, it is only taken by the cpu which popped it.
+static struct proc *runq_pop(struct cpu *c) {
+    struct proc *p = NULL;
+
+    acquire(&c->runq_lock);
+    struct rb_node *first = rb_first(&c->runq);
+    if (first) {
+        p = rb_entry(first, struct proc, rb);
+        rb_erase(&c->runq, first);
+        p->on_rq = 0;
+        c->nr_queued--;
+        c->runq_weight -= p->weight;
+        c->min_vruntime = MAX(c->min_vruntime, p->vruntime);
+    }
+    release(&c->runq_lock);
+    if (p != NULL)
+        acquire(&p->lock);
+    return p;
+}
+
+// Take the leftmost task of c which may run on thief.
+// min_vruntime is left alone: the task is not the leftmost one.
+static struct proc *runq_steal(struct cpu *c, struct cpu *thief) {
+    struct proc *p = NULL;
+
+    acquire(&c->runq_lock);
+    for (struct rb_node *node = rb_first(&c->runq); node != NULL; node = rb_next(node)) {
+        struct proc *t = rb_entry(node, struct proc, rb);
+        if (t->cpumask & (1ull << thief->cpuid)) {
+            p = t;
+            rb_erase(&c->runq, node);
+            p->on_rq = 0;
+            c->nr_queued--;
+            c->runq_weight -= p->weight;
+            break;
+        }
+    }
+    release(&c->runq_lock);
+    if (p != NULL)
+        acquire(&p->lock);
+    return p;
+}
+
+// Take t out of its run queue, before p switches to it out of turn. p is queued back by switch_out().
+// Return -1 if a cpu has just popped t and waits for t->lock: that cpu is going to run it.
+static int runq_handoff(struct proc *p, struct proc *t) {
+    assert(holding(&p->lock) && holding(&t->lock));
+    struct cpu *c = getcpu(t->rq_cpu);
+    int queued;
+
+    acquire(&c->runq_lock);
+    queued = t->on_rq;
+    if (queued) {
+        rb_erase(&c->runq, &t->rb);
+        t->on_rq = 0;
+        c->nr_queued--;
+        c->runq_weight -= t->weight;
+    }
+    release(&c->runq_lock);
+    return queued ? 0 : -1;
+}
+
+// p is about to run on c: it was queued there, or stolen from another cpu.
+static void runq_start(struct cpu *c, struct proc *p) {
+    rebase_vruntime(c, p);
+}
+
+// p has run for delta on c.
+static void runq_stop(struct cpu *c, struct proc *p, uint64 delta) {
+    p->vruntime += delta * CFS_NICE_0_WEIGHT / p->weight;
+}
+
+// Called on a timer tick: return whether the current process should give up the cpu.
+int sched_tick() {
+    assert(!intr_get());
+    struct cpu *c  = mycpu();
+    struct proc *p = c->proc;
+    uint64 ran     = r_time() - p->exec_start;
+    int resched    = 0;
+
+    acquire(&c->runq_lock);
+    struct rb_node *first = rb_first(&c->runq);
+    if (first) {
+        uint64 slice = CFS_LATENCY * p->weight / (p->weight + c->runq_weight);
+        uint64 curr  = p->vruntime + ran * CFS_NICE_0_WEIGHT / p->weight;
+        if (ran >= MAX(slice, CFS_MIN_GRANULARITY))
+            resched = 1;
+        else if (rb_entry(first, struct proc, rb)->vruntime + CFS_WAKEUP_GRANULARITY < curr)
+            resched = 1;
+    }
+    release(&c->runq_lock);
+    return resched;
+}
+
+#else  // SCHED_MLFQ, SCHED_FIFO
+
+// Multi-level feedback queue:
+//  - a task runs from the highest non-empty level, round-robin within a level.
+//  - a task using up its time slice at one level moves down a level.
+//    Ticks are charged across sleeps, so a task cannot stay on top by sleeping just before its slice ends.
+//  - a task is preempted at a tick, if a task of a higher level is waiting.
+//  - every SCHED_BOOST_TICKS, all tasks go back to their base level, so the lowest levels never starve.
+// With SCHED_FIFO there is a single level of one tick, i.e. plain round-robin.
+//
+// The queues hold struct runq_entry rather than processes: an entry cannot be taken out of the middle
+//  of a ring, so yield_to() hands the entry of its target over to the yielder instead, see runq_handoff().
+// A queued process holds exactly one entry in the queues, so they never hold more than NPROC entries.
+
+// time slice of each level, in ticks.
+#ifdef SCHED_FIFO
+static const int quantum[SCHED_NR_PRIO] = {1};
+#else
+static const int quantum[SCHED_NR_PRIO] = {1, 2, 4};
+#endif
+
+#define SCHED_BOOST_TICKS (TICKS_PER_SEC)
+
+static inline uint64 boost_epoch() {
+    return get_ticks() / SCHED_BOOST_TICKS;
+}
+
+// Apply a priority boost to p, if it has missed one.
+static void sched_refresh(struct proc *p) {
+    assert(holding(&p->lock));
+    uint64 epoch = boost_epoch();
+    if (p->boost_epoch != epoch) {
+        p->boost_epoch = epoch;
+        p->priority    = p->base_priority;
+        p->slice_ticks = 0;
+    }
+}
+
+// Apply a priority boost to the tasks already queued on c: move them up to their base level.
+// base_priority is read without p->lock, a concurrent setpriority() only misplaces the task for one round.
+// The other fields of these tasks are reset by sched_refresh() when they are picked.
+static void boost_runq(struct cpu *c) {
+    uint64 epoch = boost_epoch();
+    if (c->boost_epoch == epoch)
+        return;
+    c->boost_epoch = epoch;
+
+    for (int level = 1; level < SCHED_NR_PRIO; level++) {
+        struct queue *q = &c->runq[level];
+        struct runq_entry *e;
+        for (int n = queue_size(q); n > 0 && (e = pop_queue(q)) != NULL; n--) {
+            struct proc *p = __atomic_load_n(&e->proc, __ATOMIC_ACQUIRE);
+            if (push_queue(&c->runq[p->base_priority], e) < 0)
+                panic("run queue overflow");
+        }
+    }
+}
+
+static void runq_init(struct cpu *c) {
+    for (int level = 0; level < SCHED_NR_PRIO; level++) init_queue(&c->runq[level]);
+}
+
+static int runq_size(struct cpu *c) {
+    int size = 0;
+    for (int level = 0; level < SCHED_NR_PRIO; level++) size += queue_size(&c->runq[level]);
+    return size;
+}
+
+static void runq_push(struct cpu *c, struct proc *p) {
+    assert(holding(&p->lock));
+    sched_refresh(p);
+    p->on_rq = 1;
+    if (push_queue(&c->runq[p->priority], p->rq_entry) < 0)
+        panic("run queue overflow");
+}
+
+// Lock and return the process holding e, just popped.
+// runq_handoff() may pass e on meanwhile: follow it, the holder found under its own lock is the one.
+static struct proc *entry_proc(struct runq_entry *e) {
+    for (;;) {
+        struct proc *p = __atomic_load_n(&e->proc, __ATOMIC_ACQUIRE);
+        acquire(&p->lock);
+        if (p->rq_entry == e) {
+            assert(p->on_rq);
+            p->on_rq = 0;
+            return p;
+        }
+        release(&p->lock);
+    }
+}
+
+// Return the task locked.
+static struct proc *runq_pop(struct cpu *c) {
+    boost_runq(c);
+    for (int level = 0; level < SCHED_NR_PRIO; level++) {
+        struct runq_entry *e = pop_queue(&c->runq[level]);
+        if (e != NULL)
+            return entry_proc(e);
+    }
+    return NULL;
+}
+
+// The holder of the entry is read without its lock, a task handed the entry meanwhile
+//  is checked against the cpu again when it is picked.
+static int allowed_on(void *e, void *c) {
+    struct proc *p = __atomic_load_n(&((struct runq_entry *)e)->proc, __ATOMIC_ACQUIRE);
+    return p->cpumask & (1ull << ((struct cpu *)c)->cpuid);
+}
+
+// Take the first task of a level of c, if it may run on thief, from the highest level.
+// A task pinned elsewhere at the head of a level blocks the stealing of that level, until c runs it.
+// Return the task locked.
+static struct proc *runq_steal(struct cpu *c, struct cpu *thief) {
+    for (int level = 0; level < SCHED_NR_PRIO; level++) {
+        struct runq_entry *e = pop_queue_if(&c->runq[level], allowed_on, thief);
+        if (e != NULL)
+            return entry_proc(e);
+    }
+    return NULL;
+}
+
+// Take t out of its run queue, before p switches to it out of turn:
+//  swap their entries, p takes the place of t in the queue and t holds the entry p left unqueued.
+// A cpu which has just popped the entry of t finds p holding it, see entry_proc().
+static int runq_handoff(struct proc *p, struct proc *t) {
+    assert(holding(&p->lock) && holding(&t->lock));
+    assert(!p->on_rq && t->on_rq);
+    struct runq_entry *pe = p->rq_entry;
+    struct runq_entry *te = t->rq_entry;
+
+    p->rq_entry = te;
+    t->rq_entry = pe;
+    __atomic_store_n(&te->proc, p, __ATOMIC_RELEASE);
+    __atomic_store_n(&pe->proc, t, __ATOMIC_RELEASE);
+    p->on_rq       = 1;
+    t->on_rq       = 0;
+    p->queued_time = r_time();
+    return 0;
+}
+
+static void runq_start(struct cpu *c, struct proc *p) {
+    sched_refresh(p);
+}
+
+static void runq_stop(struct cpu *c, struct proc *p, uint64 delta) {
+}
+
+// Charge a timer tick to the current process.
+// Return whether it should give up the cpu:
+//  it has used up its time slice and moves down a level, or a task of a higher level is waiting here.
+int sched_tick() {
+    assert(!intr_get());
+    struct cpu *c  = mycpu();
+    struct proc *p = c->proc;
+    int resched    = 0;
+
+    acquire(&p->lock);
+    if (++p->slice_ticks >= quantum[p->priority]) {
+        if (p->priority < SCHED_NR_PRIO - 1)
+            p->priority++;
+        p->slice_ticks = 0;
+        resched        = 1;
+    } else {
+        for (int level = 0; level < p->priority; level++)
+            if (queue_size(&c->runq[level]) > 0)
+                resched = 1;
+    }
+    release(&p->lock);
+    return resched;
+}
+
+#endif  // SCHED_CFS
 
 void sched_init() {
-    init_queue(&task_queue);
+    for (int i = 0; i < NCPU; i++) runq_init(getcpu(i));
 }
 
+// Pick the cpu with the most queued tasks.
+// Sizes are read without locks, the result is only a hint.
+static struct cpu *busiest_cpu() {
+    struct cpu *busiest = NULL;
+    int max             = 0;
+    for (int i = 0; i < NCPU; i++) {
+        struct cpu *c = getcpu(i);
+        int size      = runq_size(c);
+        if (size > max) {
+            max     = size;
+            busiest = c;
+        }
+    }
+    return busiest;
+}
+
+// Return a task from the run queues, locked.
 static struct proc *fetch_task() {
-    struct proc *proc = pop_queue(&task_queue);
-    if (proc != NULL)
-        debugf("fetch task (pid=%d) from task queue", proc->pid);
-    return proc;
+    struct cpu *c     = mycpu();
+    struct proc *proc = runq_pop(c);
+    if (proc != NULL) {
+        c->nr_local++;
+        debugf("fetch task (pid=%d) from local queue", proc->pid);
+        return proc;
+    }
+
+    // the busiest queue may get drained before we lock it, or hold only tasks pinned elsewhere:
+    //  retry a few times.
+    for (int retry = 0; retry < NCPU; retry++) {
+        struct cpu *victim = busiest_cpu();
+        if (victim == NULL)
+            break;
+        proc = runq_steal(victim, c);
+        if (proc != NULL) {
+            c->nr_steal++;
+            debugf("steal task (pid=%d) from cpu %d", proc->pid, victim->cpuid);
+            return proc;
+        }
+    }
+    return NULL;
+}
+
+// cpus parked in wfi, without a periodic tick: they only notice new tasks when kicked by an IPI.
+static uint64 idle_mask;
+
+// cpus which have entered the scheduler.
+uint64 online_mask;
+
+// Find an idle cpu in mask.
+static struct cpu *find_idle_cpu(uint64 mask) {
+    mask &= idle_mask;
+    for (int i = 0; i < NCPU; i++)
+        if (mask & (1ull << i))
+            return getcpu(i);
+    return NULL;
+}
+
+// Pick the cpu to queue p on: the cpu it last ran on, or this one, or any idle cpu, if p may run there.
+static struct cpu *select_cpu(struct proc *p) {
+    struct cpu *me = mycpu();
+    if (p->last_cpu >= 0 && (p->cpumask & (1ull << p->last_cpu)))
+        return getcpu(p->last_cpu);
+    if (p->cpumask & (1ull << me->cpuid))
+        return me;
+    struct cpu *c = find_idle_cpu(p->cpumask);
+    if (c != NULL)
+        return c;
+    for (int i = 0; i < NCPU; i++)
+        if (p->cpumask & online_mask & (1ull << i))
+            return getcpu(i);
+    panic("proc %d has no cpu to run on", p->pid);
+}
+
+// Wake up an idle cpu with an IPI, at most one in flight per cpu.
+static void kick_cpu(struct cpu *c) {
+    if (__sync_lock_test_and_set(&c->ipi_pending, 1) == 0) {
+        c->nr_ipi++;
+        sbi_send_ipi(1, c->mhart_id);
+    }
 }
 
+// Handle the IPI sent by kick_cpu(): the wakeup is all it takes, the scheduler loop finds the task.
+void sched_ipi() {
+    struct cpu *c = mycpu();
+    w_sip(r_sip() & ~SIE_SSIE);
+    __sync_lock_release(&c->ipi_pending);
+}
+
+// Queue p, and make sure a cpu is going to run it.
+static void enqueue_task(struct proc *p) {
+    struct cpu *me = mycpu();
+    struct cpu *c  = select_cpu(p);
+    p->queued_time = r_time();
+    runq_push(c, p);
+    debugf("add task (pid=%d) to cpu %d", p->pid, c->cpuid);
+
+    // the task must be visible before idle_mask is read, as cpu_idle() sets its bit before looking at the queues:
+    //  a cpu going idle either finds the task, or is in idle_mask. Neither the release of the runq lock (cfs)
+    //  nor the publishing store of the ring slot orders a later load, so it takes a full fence.
+    MEMORY_FENCE();
+    if (c != me && (idle_mask & (1ull << c->cpuid))) {
+        // the target is idle, wake it up.
+        kick_cpu(c);
+    } else if (c != me || me->proc != NULL) {
+        // the target is busy: wake up an idle cpu to steal the task.
+        // But not if the task is queued here and this cpu is in the scheduler loop, which picks it up next.
+        struct cpu *idle = find_idle_cpu(p->cpumask & ~(1ull << me->cpuid));
+        if (idle != NULL)
+            kick_cpu(idle);
+    }
+}
+
+// Queue a new or woken up task.
 void add_task(struct proc *p) {
     assert(p->state == RUNNABLE);
     assert(holding(&p->lock));
 
-    push_queue(&task_queue, p);
-    debugf("add task (pid=%d) to task queue", p->pid);
+    p->wakeup_time = r_time();
+    enqueue_task(p);
 }
 
 static int all_dead() {
-    push_off();
-    int alive = 0;
-    for (int i = 0; i < NPROC; i++) {
-        struct proc *p = pool[i];
-        // it's ok to read an out-dated UNUSED state,
-        //  so omit acquire&release here
-        if (p->state != UNUSED)
-            alive = true;
-        if (alive)
-            break;
+    return nr_procs == 0;
+}
+
+// Park this cpu until an interrupt arrives.
+// Tickless: the periodic tick is stopped, the timer is programmed for the nearest sleep deadline only.
+// add_task() kicks an idle cpu with an IPI, IDLE_MAX_TICKS bounds the idle period in case an IPI is lost.
+#define IDLE_MAX_TICKS (TICKS_PER_SEC)
+
+static void cpu_idle(struct cpu *c) {
+    __sync_fetch_and_or(&idle_mask, 1ull << c->cpuid);
+    if (busiest_cpu() == NULL) {
+        uint64 now = get_ticks();
+        set_timer_at(MIN(next_deadline, now + IDLE_MAX_TICKS));
+
+        uint64 t0 = r_time();
+        // with intr off, wfi still returns on a pending interrupt, which is taken right below.
+        asm volatile("wfi");
+        c->idle_time += r_time() - t0;
+        intr_on();
+        intr_off();
+        // woken up by an IPI or a device rather than the timer: restart the periodic tick
+        //  for the task about to run, or it would not be preempted before the idle timeout.
+        set_next_timer();
+    }
+    __sync_fetch_and_and(&idle_mask, ~(1ull << c->cpuid));
+}
+
+// Make p the current process of c, before switching to it.
+// Called with p->lock held.
+static void switch_in(struct cpu *c, struct proc *p) {
+    runq_start(c, p);
+    p->state      = RUNNING;
+    p->last_cpu   = c->cpuid;
+    p->exec_start = r_time();
+    p->run_delay += p->exec_start - p->queued_time;
+    p->nr_runs++;
+    c->nr_switches++;
+    c->proc = p;
+    if (p->wakeup_time) {
+        uint64 latency = p->exec_start - p->wakeup_time;
+        c->nr_wakeups++;
+        c->wakeup_latency += latency;
+        c->wakeup_latency_max = MAX(c->wakeup_latency_max, latency);
+        p->wakeup_time        = 0;
+    }
+}
+
+// p, the current process of c, stops running: account its run, and queue it back if it is still RUNNABLE.
+// Called with p->lock held, maybe before switching away from it:
+//  a cpu picking p up from the queue waits on p->lock until the switch is done.
+static void switch_out(struct cpu *c, struct proc *p) {
+    c->proc = NULL;
+
+    uint64 delta = r_time() - p->exec_start;
+    p->sum_exec_runtime += delta;
+    runq_stop(c, p, delta);
+
+    // preempted or yielded: queue it back here, this is not a wakeup.
+    // Unless runq_handoff() has queued it already in the place of the task it yields to.
+    if (p->state == RUNNABLE && !p->on_rq) {
+        if (p->cpumask & (1ull << c->cpuid)) {
+            p->queued_time = r_time();
+            runq_push(c, p);
+        } else {
+            enqueue_task(p);
+        }
+    }
+}
+
+// Release the lock of the process sched() switched away from.
+// Called first thing by a process resumed by swtch(), see sched() and first_sched_ret().
+void finish_switch() {
+    struct cpu *c     = mycpu();
+    struct proc *prev = c->prev;
+    if (prev != NULL) {
+        c->prev = NULL;
+        release(&prev->lock);
     }
-    pop_off();
-    return !alive;
 }
 
 // Scheduler never returns.  It loops, doing:
 //  - choose a process to run.
 //  - swtch to start running that process.
-//  - eventually that process transfers control
-//    via swtch back to the scheduler.
+//  - eventually a process transfers control
+//    via swtch back to the scheduler, when sched() finds nothing else to run.
 void scheduler() {
     struct proc *p;
     struct cpu *c = mycpu();
@@ -59,45 +564,71 @@ void scheduler() {
     // If this scheduler finds any possible process to run, it will switch to it.
     // 	And the scheduler context is saved on "mycpu()->sched_context"
 
+    __sync_fetch_and_or(&online_mask, 1ull << c->cpuid);
+
     for (;;) {
         // intr may be on here.
 
         p = fetch_task();
         if (p == NULL) {
-            // if we cannot find a process in the task_queue
+            // if we cannot find a process in any run queue
             //  maybe some processes are SLEEPING and some are RUNNABLE
             if (all_dead()) {
                 panic("[cpu %d] scheduler dead.", c->cpuid);
             } else {
-                // nothing to run; stop running on this core until an interrupt.
-                intr_on();
-                asm volatile("wfi");
-                intr_off();
+                // nothing to run; spend the idle time on clearing free pages,
+                if (kpgmgr_idle_work())
+                    continue;
+                // or stop running on this core until an interrupt.
+                cpu_idle(c);
                 continue;
             }
         }
 
-        acquire(&p->lock);
         assert(p->state == RUNNABLE);
+        if (!(p->cpumask & (1ull << c->cpuid))) {
+            // its affinity has changed since it was queued.
+            enqueue_task(p);
+            release(&p->lock);
+            continue;
+        }
         debugf("switch to proc %d(%d)", p->index, p->pid);
-        p->state = RUNNING;
-        c->proc  = p;
+        switch_in(c, p);
         swtch(&c->sched_context, &p->context);
 
         // When we get back here, someone must have called swtch(..., &c->sched_context);
-        assert(c->proc == p);
+        // It may not be p: processes switch directly to each other in sched().
+        p = c->proc;
+        assert(p != NULL);
         assert(!intr_get());        // scheduler should never have intr_on()
         assert(holding(&p->lock));  // whoever switch to us must acquire p->lock
-        c->proc = NULL;
-
-        if (p->state == RUNNABLE) {
-            add_task(p);
-        }
+        switch_out(c, p);
         release(&p->lock);
     }
 }
 
-// Switch to scheduler.  Must hold only p->lock
+// Pick the process sched() switches to, and lock it.
+// Lock order: the current process, then a queued one.
+//  Nobody waits for the lock of a running process, while holding the lock of a queued one.
+static struct proc *pick_next(struct cpu *c) {
+    struct proc *next = fetch_task();
+    if (next == NULL)
+        return NULL;
+
+    assert(next != c->proc);
+    assert(next->state == RUNNABLE);
+    if (!(next->cpumask & (1ull << c->cpuid))) {
+        // its affinity has changed since it was queued.
+        enqueue_task(next);
+        release(&next->lock);
+        return NULL;
+    }
+    return next;
+}
+
+static void switch_to(struct cpu *c, struct proc *p, struct proc *next);
+
+// Switch to the next process, or to the scheduler if there is none.  Must hold only p->lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
 // kernel thread, not this CPU. It should
@@ -105,36 +636,94 @@ void scheduler() {
 // break in the few places where a lock is held but
 // there's no process.
 void sched() {
-    int interrupt_on;
     struct proc *p = curr_proc();
+    struct cpu *c  = mycpu();
 
     if (!holding(&p->lock))
         panic("not holding p->lock");
-    if (mycpu()->noff != 1)
+    if (c->noff != 1)
         panic("holding another locks");
     if (p->state == RUNNING)
         panic("sched running process");
-    if (mycpu()->inkernel_trap)
+    if (c->inkernel_trap)
         panic("sched should never be called in kernel trap context.");
     assert(!intr_get());
 
-    interrupt_on = mycpu()->interrupt_on;
-    debugf("switch to scheduler %d(%d)", p->index, p->pid);
-    swtch(&p->context, &mycpu()->sched_context);
+    switch_to(c, p, pick_next(c));
+}
+
+// Switch from p to next (locked), or go on running p / switch to the scheduler if next is NULL.
+static void switch_to(struct cpu *c, struct proc *p, struct proc *next) {
+    int interrupt_on = c->interrupt_on;
+
+    if (next != NULL) {
+        // switch to next directly: one swtch instead of two through the scheduler context.
+        // p is queued back with its lock held, next releases it in finish_switch().
+        debugf("switch from %d(%d) to %d(%d)", p->index, p->pid, next->index, next->pid);
+        switch_out(c, p);
+        switch_in(c, next);
+        c->prev = p;
+        c->nr_direct++;
+        swtch(&p->context, &next->context);
+    } else if (p->state == RUNNABLE && (p->cpumask & (1ull << c->cpuid))) {
+        // nothing else to run, go on running p.
+        p->state = RUNNING;
+    } else {
+        debugf("switch to scheduler %d(%d)", p->index, p->pid);
+        swtch(&p->context, &c->sched_context);
+    }
+
+    // we are resumed by the scheduler, or by another process switching to us directly.
+    finish_switch();
     mycpu()->interrupt_on = interrupt_on;
 
-    // if scheduler returns here: p->lock must be holding.
+    // p->lock must be holding.
     if (!holding(&p->lock))
         panic("not holding p->lock after sched.swtch returns");
 }
 
-// Give up the CPU for one scheduling round.
-void yield() {
+// Switch from the current process p to t out of turn, see yield_to().
+// Must hold only p->lock and t->lock, t being RUNNABLE and allowed on this cpu.
+// Return -EINVAL, p still running, if a cpu is about to run t already; t->lock is released either way.
+int sched_to(struct proc *t) {
+    struct proc *p = curr_proc();
+    struct cpu *c  = mycpu();
+
+    assert(holding(&p->lock) && holding(&t->lock));
+    assert(c->noff == 2);
+    assert(p->state == RUNNING && t->state == RUNNABLE);
+    assert(t->cpumask & (1ull << c->cpuid));
+
+    if (runq_handoff(p, t) < 0) {
+        release(&t->lock);
+        return -EINVAL;
+    }
+    p->state = RUNNABLE;
+    p->nr_voluntary++;
+    switch_to(c, p, t);
+    return 0;
+}
+
+static void __yield(int voluntary) {
     struct proc *p = curr_proc();
     debugf("yield: (%d)%p", p->pid, p);
 
     acquire(&p->lock);
     p->state = RUNNABLE;
+    if (voluntary)
+        p->nr_voluntary++;
+    else
+        p->nr_involuntary++;
     sched();
     release(&p->lock);
 }
+
+// Give up the CPU for one scheduling round.
+void yield() {
+    __yield(1);
+}
+
+// Give up the CPU because the time slice is used up, see sched_tick().
+void preempt() {
+    __yield(0);
+}
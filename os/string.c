@@ -4,10 +4,25 @@
 void *memset(void *dst, int c, uint n)
 {
 	char *cdst = (char *)dst;
-	int i;
-	for (i = 0; i < n; i++) {
-		cdst[i] = c;
+	uint64 *wdst;
+	uint64 word;
+
+	// byte stores until dst is 8-byte aligned, then word stores.
+	while (n > 0 && ((uint64)cdst & 7)) {
+		*cdst++ = c;
+		n--;
 	}
+
+	word = (uchar)c;
+	word |= word << 8;
+	word |= word << 16;
+	word |= word << 32;
+	for (wdst = (uint64 *)cdst; n >= 8; n -= 8)
+		*wdst++ = word;
+
+	cdst = (char *)wdst;
+	while (n-- > 0)
+		*cdst++ = c;
 	return dst;
 }
 
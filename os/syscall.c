@@ -11,10 +11,19 @@ int64 sys_fork() {
     return fork();
 }
 
+static void free_args(char *arg[]) {
+    for (int i = 0; i < MAXARG && arg[i]; i++) {
+        kfree_sized(arg[i], strlen(arg[i]) + 1);
+    }
+}
+
 int64 sys_exec(uint64 __user path, uint64 __user argv) {
     int ret;
     char *kpath = kalloc(&kstrbuf);
     char *arg[MAXARG];
+    char kbuf[KSTRING_MAX];
+    if (kpath == NULL)
+        return -ENOMEM;
     memset(kpath, 0, KSTRING_MAX);
     memset(arg, 0, sizeof(arg));
 
@@ -36,11 +45,16 @@ int64 sys_exec(uint64 __user path, uint64 __user argv) {
             arg[i] = 0;
             break;
         }
-        arg[i] = kalloc(&kstrbuf);
-        assert(arg[i] != NULL);
-        if ((ret = copystr_from_user(p->mm, arg[i], useraddr, KSTRING_MAX)) < 0) {
+        // size each argument to its length.
+        if ((ret = copystr_from_user(p->mm, kbuf, useraddr, KSTRING_MAX)) < 0) {
             goto free;
         }
+        int len = strlen(kbuf) + 1;
+        if ((arg[i] = kmalloc(len)) == NULL) {
+            ret = -ENOMEM;
+            goto free;
+        }
+        memmove(arg[i], kbuf, len);
     }
     release(&p->mm->lock);
 
@@ -49,17 +63,13 @@ int64 sys_exec(uint64 __user path, uint64 __user argv) {
     ret = exec(kpath, arg);
 
     kfree(&kstrbuf, kpath);
-    for (int i = 0; arg[i]; i++) {
-        kfree(&kstrbuf, arg[i]);
-    }
+    free_args(arg);
     return ret;
 
 free:
     release(&p->mm->lock);
     kfree(&kstrbuf, kpath);
-    for (int i = 0; arg[i]; i++) {
-        kfree(&kstrbuf, arg[i]);
-    }
+    free_args(arg);
     return ret;
 }
 
@@ -70,20 +80,34 @@ int64 sys_exit(int code) {
 
 int64 sys_wait(int pid, uint64 __user va) {
     struct proc *p = curr_proc();
-    int *code      = NULL;
-
-    acquire(&p->lock);
-    acquire(&p->mm->lock);
-    release(&p->lock);
+    int code;
+    int64 ret;
 
+    // the exit code goes through copy_to_user: the page at va may be shared copy-on-write.
+    // Check va before reaping, or a bad va would lose the child, pid and status both:
+    //  write the int there back as it is, which also breaks copy-on-write, so the copy below cannot fail.
     if (va != 0) {
-        uint64 pa = useraddr(p->mm, va);
-        code      = (int *)PA_TO_KVA(pa);
+        acquire(&p->lock);
+        acquire(&p->mm->lock);
+        release(&p->lock);
+        ret = copy_from_user(p->mm, (char *)&code, va, sizeof(code));
+        if (ret == 0)
+            ret = copy_to_user(p->mm, va, (char *)&code, sizeof(code));
+        release(&p->mm->lock);
+        if (ret < 0)
+            return ret;
     }
 
+    if ((ret = wait(pid, &code)) < 0 || va == 0)
+        return ret;
+
+    acquire(&p->lock);
+    acquire(&p->mm->lock);
+    release(&p->lock);
+    copy_to_user(p->mm, va, (char *)&code, sizeof(code));
     release(&p->mm->lock);
 
-    return wait(pid, code);
+    return ret;
 }
 
 int64 sys_getpid() {
@@ -116,13 +140,15 @@ int64 sys_sleep(int64 n) {
     struct proc *p = curr_proc();
 
     acquire(&tickslock);
-    uint64 ticks0 = ticks;
-    while (ticks - ticks0 < n) {
+    uint64 deadline = get_ticks() + n;
+    while (get_ticks() < deadline) {
         if (iskilled(p)) {
             release(&tickslock);
             return -1;
         }
-        sleep(&ticks, &tickslock);
+        // only the sleepers whose deadline has passed are woken up, see handle_intr().
+        next_deadline = MIN(next_deadline, deadline);
+        sleep_on_key(&ticks_wq, deadline, &tickslock);
     }
     release(&tickslock);
     return 0;
@@ -133,6 +159,46 @@ int64 sys_yield() {
     return 0;
 }
 
+int64 sys_yield_to(int pid) {
+    return yield_to(pid);
+}
+
+int64 sys_setpriority(int pid, int prio) {
+    return setpriority(pid, prio);
+}
+
+int64 sys_sched_setaffinity(int pid, uint64 mask) {
+    int ret = sched_setaffinity(pid, mask);
+    // leave this cpu now, if the caller is no longer allowed on it.
+    if (ret == 0 && (pid == 0 || pid == curr_proc()->pid)) {
+        push_off();
+        int stay = (mask & (1ull << cpuid())) != 0;
+        pop_off();
+        if (!stay)
+            yield();
+    }
+    return ret;
+}
+
+int64 sys_sched_getaffinity(int pid) {
+    return sched_getaffinity(pid);
+}
+
+int64 sys_schedstat(int pid, uint64 __user st) {
+    struct proc *p = curr_proc();
+    struct schedstat kst;
+    int64 ret;
+
+    if ((ret = get_schedstat(pid, &kst)) < 0)
+        return ret;
+
+    acquire(&p->mm->lock);
+    ret = copy_to_user(p->mm, st, (char *)&kst, sizeof(kst));
+    release(&p->mm->lock);
+
+    return ret;
+}
+
 int64 sys_sbrk(int64 n) {
     int64 ret;
     struct proc *p = curr_proc();
@@ -180,6 +246,25 @@ int64 sys_write(int fd, uint64 __user va, uint len) {
     return user_console_write(va, len);
 }
 
+// Time since boot, for user-space measurements.
+int64 sys_gettimeofday(uint64 __user val, int _tz) {
+    struct proc *p = curr_proc();
+    uint64 cycle   = get_cycle();
+    TimeVal t;
+    int64 ret;
+
+    t.sec  = cycle / CPU_FREQ;
+    t.usec = (cycle % CPU_FREQ) * 1000000 / CPU_FREQ;
+
+    acquire(&p->lock);
+    acquire(&p->mm->lock);
+    release(&p->lock);
+    ret = copy_to_user(p->mm, val, (char *)&t, sizeof(t));
+    release(&p->mm->lock);
+
+    return ret;
+}
+
 void syscall() {
     struct trapframe *trapframe = curr_proc()->trapframe;
     int id                      = trapframe->a7;
@@ -214,6 +299,21 @@ void syscall() {
         case SYS_yield:
             ret = sys_yield();
             break;
+        case SYS_yield_to:
+            ret = sys_yield_to(args[0]);
+            break;
+        case SYS_setpriority:
+            ret = sys_setpriority(args[0], args[1]);
+            break;
+        case SYS_sched_setaffinity:
+            ret = sys_sched_setaffinity(args[0], args[1]);
+            break;
+        case SYS_sched_getaffinity:
+            ret = sys_sched_getaffinity(args[0]);
+            break;
+        case SYS_schedstat:
+            ret = sys_schedstat(args[0], args[1]);
+            break;
         case SYS_sbrk:
             ret = sys_sbrk(args[0]);
             break;
@@ -226,6 +326,9 @@ void syscall() {
         case SYS_write:
             ret = sys_write(args[0], args[1], args[2]);
             break;
+        case SYS_gettimeofday:
+            ret = sys_gettimeofday(args[0], args[1]);
+            break;
         case SYS_ktest:
             ret = ktest_syscall(args);
             break;
@@ -9,8 +9,14 @@
 #define SYS_getppid 6
 #define SYS_kill    7
 
-#define SYS_sleep 10
-#define SYS_yield 11
+#define SYS_sleep       10
+#define SYS_yield       11
+#define SYS_setpriority 12
+
+#define SYS_sched_setaffinity 13
+#define SYS_sched_getaffinity 14
+#define SYS_schedstat         15
+#define SYS_yield_to          16
 
 #define SYS_sbrk 20
 #define SYS_mmap 21
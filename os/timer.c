@@ -10,6 +10,11 @@ uint64 get_cycle() {
     return r_time();
 }
 
+/// ticks since boot, derived from `mtime`
+uint64 get_ticks() {
+    return r_time() / (CPU_FREQ / TICKS_PER_SEC);
+}
+
 /// Enable timer interrupt
 void timer_init() {
     // Enable supervisor timer interrupt
@@ -25,4 +30,14 @@ void set_next_timer() {
     } else {
         w_stimecmp(r_time() + timebase);
     }
+}
+
+// Set the next timer interrupt at the given tick, instead of the next periodic one.
+void set_timer_at(uint64 tick) {
+    const uint64 timebase = CPU_FREQ / TICKS_PER_SEC;
+    if (on_vf2_board) {
+        set_timer(tick * timebase);
+    } else {
+        w_stimecmp(tick * timebase);
+    }
 }
\ No newline at end of file
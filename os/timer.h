@@ -8,8 +8,10 @@
 #define CPU_FREQ (12500000)
 
 uint64 get_cycle();
+uint64 get_ticks();
 void timer_init();
 void set_next_timer();
+void set_timer_at(uint64 tick);
 
 typedef struct {
     uint64 sec;   // 自 Unix 纪元起的秒数
@@ -11,8 +11,10 @@
 static int64 kp_print_lock = 0;
 extern volatile int panicked;
 
+// the earliest tick a sleep() waits for, -1 if none. Protected by tickslock.
 struct spinlock tickslock;
-uint64 ticks;
+uint64 next_deadline = -1;
+struct wait_queue ticks_wq;  // processes in sys_sleep(), keyed by their deadline
 
 void plic_handle() {
     int irq = plic_claim();
@@ -30,10 +32,11 @@ static int handle_intr(void) {
     uint64 code  = cause & SCAUSE_EXCEPTION_CODE_MASK;
     if (code == SupervisorTimer) {
         tracef("time interrupt!");
-        if (cpuid() == 0) {
+        // any hart may be the first to wake up after the deadline, idle harts have no periodic tick.
+        if (get_ticks() >= next_deadline) {
             acquire(&tickslock);
-            ticks++;
-            wakeup(&ticks);
+            if (get_ticks() >= next_deadline)
+                next_deadline = wake_up_to(&ticks_wq, get_ticks());
             release(&tickslock);
         }
         set_next_timer();
@@ -42,6 +45,10 @@ static int handle_intr(void) {
         tracef("s-external interrupt from usertrap!");
         plic_handle();
         return 2;
+    } else if (code == SupervisorSoft) {
+        tracef("ipi!");
+        sched_ipi();
+        return 3;
     } else {
         return 0;
     }
@@ -109,6 +116,8 @@ void set_kerneltrap() {
 void trap_init() {
     set_kerneltrap();
     spinlock_init(&tickslock, "user-time");
+    // enable IPIs, see sched_ipi().
+    w_sie(r_sie() | SIE_SSIE);
 }
 
 // UserTrap begins
@@ -125,7 +134,6 @@ static void handle_pgfault(void) {
     acquire(&mm->lock);
     release(&p->lock);
     pte = walk(mm, addr, 0);
-    release(&mm->lock);
 
     //	docs: Volume II: RISC-V Privileged Architectures V1.10, Page 61,
     //		> Two schemes to manage the A and D bits are permitted:
@@ -140,30 +148,23 @@ static void handle_pgfault(void) {
             // - Store PageFault  : Missing A/D bit
             *pte |= PTE_A;
             if (cause == StorePageFault)
-                *pte |= PTE_D;    
+                *pte |= PTE_D;
+            release(&mm->lock);
             return;
         }
     }
-    // Assignment 3 CoW: do copy here.
-    // checkpoint 1 start
-    if (*pte & PTE_V) {
-        uint64 pa_old = PTE2PA(*pte);
-        if (!pa_old) {
-            errorf("[C1] oldpte to pa failed, oldpte = %p", *pte);
-            setkilled(p, -2);
-        }
-        void *pa_new = kallocpage();
-        if (!pa_new) {
-            errorf("[C1] kallocpage failed");
+
+    // Assignment 3 CoW: a store to a shared page, do copy here.
+    if (cause == StorePageFault && pte != NULL && (*pte & PTE_A3_COW)) {
+        int ret = mm_cow_fault(mm, addr);
+        release(&mm->lock);
+        if (ret < 0) {
+            warnf("CoW fault at %p failed: %d", addr, ret);
             setkilled(p, -2);
         }
-        void *__kva kva_old = (void *)PA_TO_KVA(pa_old);
-        void *__kva kva_new = (void *)PA_TO_KVA(pa_new);
-        memmove(kva_new, kva_old, PGSIZE);
-        *pte = PA2PTE(pa_new) | mm->vma->pte_flags | PTE_W | PTE_V;
         return;
     }
-    // checkpoint 1 end
+    release(&mm->lock);
 
     // otherwise, it is a page fault due to invalid address
     infof("page fault in application, bad addr = %p, bad instruction = %p, core dumped.", r_stval(), p->trapframe->epc);
@@ -219,9 +220,9 @@ void usertrap() {
     if ((killed = iskilled(p)) != 0)
         exit(killed);
 
-    // if it's a timer intr, call yield to give up CPU.
-    if (which_dev == 1)
-        yield();
+    // if it's a timer intr and the time slice is used up, call yield to give up CPU.
+    if (which_dev == 1 && sched_tick())
+        preempt();
 
     // prepare for return to user mode
     assert(!intr_get());
@@ -128,7 +128,8 @@ void trap_init();
 void kerneltrap(struct ktrapframe *ktf);
 void usertrapret();
 
-extern uint64 ticks;
+extern uint64 next_deadline;
 extern struct spinlock tickslock;
+extern struct wait_queue ticks_wq;
 
 #endif  // TRAP_H
\ No newline at end of file
@@ -12,8 +12,11 @@ int copy_to_user(struct mm *mm, uint64 __user dstva, char *src, uint64 len) {
 
     while (len > 0) {
         va0 = PGROUNDDOWN(dstva);
-        pa0 = walkaddr(mm, va0);
         // Assignment 3 CoW: do CoW if the page is marked as CoW page.
+        pte_t *pte = walk(mm, va0, 0);
+        if (pte != NULL && (*pte & PTE_V) && (*pte & PTE_A3_COW) && mm_cow_fault(mm, va0) < 0)
+            return -ENOMEM;
+        pa0 = walkaddr(mm, va0);
         if (pa0 == 0)
             return -EINVAL;
         n = PGSIZE - (dstva - va0);
@@ -8,45 +8,42 @@ static allocator_t vma_allocator;
 
 /**
  * Assignment 3: CoW: reference counting for user pages
+ *
+ * The refcnt lives in the page descriptor (see struct page in kalloc.h),
+ *  and is updated atomically: sharers of a page hold different mm locks, and no kpagelock.
  */
 
-#define NR_OF_PAGES (PHYS_MEM_SIZE / PGSIZE)
-int8 refcnt[NR_OF_PAGES];
-
 /**
  * @brief increase the refcnt for pa, and return the *updated* refcnt.
  */
-int8 page_refcnt_increase(uint64 pa) {
+int page_refcnt_increase(uint64 pa) {
     assert(PGALIGNED(pa));
     assert(VALID_PHYS_ADDR(pa));
 
-    // Hint: pa must fit in this range: [RISCV_DDR_BASE, RISCV_DDR_BASE + PHYS_MEM_SIZE)
-    //  For each page (Page-Aligned PA), we use an element (int8) in the `refcnt` array to represent its refcnt.
-
-    uint64 idx = 0;
-    // TODO: calculate the index of pa into the `refcnt` array.
-    assert(idx < NR_OF_PAGES);  // never overflow
-    return 0;
+    int refcnt = __sync_add_and_fetch(&pa_to_page(pa)->refcnt, 1);
+    assert(refcnt > 1);  // never on a free page
+    return refcnt;
 }
 
 /**
  * @brief decrease the refcnt for pa, and return the updated refcnt.
  */
-int8 page_refcnt_decrease(uint64 pa) {
+int page_refcnt_decrease(uint64 pa) {
     assert(PGALIGNED(pa));
     assert(VALID_PHYS_ADDR(pa));
-    uint64 idx = 0;
-    // TODO: calculate the index of pa into the `refcnt` array.
-    assert(idx < NR_OF_PAGES);  // never overflow
-    return 0;
+
+    int refcnt = __sync_sub_and_fetch(&pa_to_page(pa)->refcnt, 1);
+    assert(refcnt >= 0);  // never underflow
+    return refcnt;
 }
 
+static void mm_ctor(void *obj) {
+    struct mm *mm = obj;
+    spinlock_init(&mm->lock, "mm");
+}
 
 void uvm_init() {
-    // Assignment 3: CoW: clear the reference counting array.
-    memset(refcnt, 0, sizeof(refcnt));
-
-    allocator_init(&mm_allocator, "mm", sizeof(struct mm), 16384);
+    allocator_init_ctor(&mm_allocator, "mm", sizeof(struct mm), 16384, mm_ctor);
     allocator_init(&vma_allocator, "vma", sizeof(struct vma), 16384);
 }
 
@@ -77,11 +74,11 @@ pte_t *walk(struct mm *mm, uint64 va, int alloc) {
         } else {
             if (!alloc)
                 return 0;
-            void *pa = kallocpage();
+            void *pa = kallocpage_zeroed();
             if (!pa)
                 return 0;
+            page_set_type((uint64)pa, PAGE_PGTABLE);
             pagetable = (pagetable_t)PA_TO_KVA(pa);
-            memset(pagetable, 0, PGSIZE);
             *pte = PA2PTE(KVA_TO_PA(pagetable)) | PTE_V;
         }
     }
@@ -130,19 +127,23 @@ uint64 useraddr(struct mm *mm, uint64 va) {
  * Then map the trapframe and trampoline in the new mm.
  */
 struct mm *mm_create(struct trapframe *tf) {
+    // mm->lock is initialized by mm_ctor.
     struct mm *mm = kalloc(&mm_allocator);
-    memset(mm, 0, sizeof(*mm));
-    spinlock_init(&mm->lock, "mm");
+    if (mm == NULL)
+        return NULL;
+    mm->pgt    = NULL;
     mm->vma    = NULL;
     mm->refcnt = 1;
+    mm->rss    = 0;
 
-    void *pa = kallocpage();
+    void *pa = kallocpage_zeroed();
     if (!pa) {
         warnf("kallocpage failed for root page table");
-        goto free_mm;
+        kfree(&mm_allocator, mm);
+        return NULL;
     }
+    page_set_type((uint64)pa, PAGE_PGTABLE);
     mm->pgt = (pagetable_t)PA_TO_KVA(pa);
-    memset(mm->pgt, 0, PGSIZE);
     acquire(&mm->lock);
 
     // map trapframe and trampoline in the new mm
@@ -166,27 +167,93 @@ struct vma *mm_create_vma(struct mm *mm) {
     assert(holding(&mm->lock));
 
     struct vma *vma = kalloc(&vma_allocator);
-    memset(vma, 0, sizeof(*vma));
-    vma->owner = mm;
+    if (vma == NULL)
+        return NULL;
+    vma->owner     = mm;
+    vma->next      = NULL;
+    vma->vm_start  = 0;
+    vma->vm_end    = 0;
+    vma->pte_flags = 0;
     return vma;
 }
 
-static void freevma(struct vma *vma, int free_phy_page) {
+// Unmap [start, end) of vma, and drop a reference to each physical page if free_phy_page.
+// Pages no longer referenced by anyone are freed in one batch.
+static void vma_unmap_range(struct vma *vma, uint64 start, uint64 end, int free_phy_page) {
     assert(holding(&vma->owner->lock));
-    assert(PGALIGNED(vma->vm_start) && PGALIGNED(vma->vm_end));
+    assert(PGALIGNED(start) && PGALIGNED(end));
 
-    struct mm *mm = vma->owner;
-    for (uint64 va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
+    struct mm *mm             = vma->owner;
+    struct linklist *freelist = NULL;
+    for (uint64 va = start; va < end; va += PGSIZE) {
         pte_t *pte = walk(mm, va, false);
         if (pte && (*pte & PTE_V)) {
-            if (free_phy_page)
-                kfreepage((void *)PTE2PA(*pte));
+            uint64 __pa pa = PTE2PA(*pte);
+            if (free_phy_page) {
+                __sync_sub_and_fetch(&pa_to_page(pa)->mapcount, 1);
+                if (page_refcnt_decrease(pa) == 0)
+                    kpagelist_add(&freelist, (void *)pa);
+            }
             *pte = 0;
+            mm->rss--;
         } else {
             debugf("free unmapped address %p", va);
         }
     }
     sfence_vma();
+    kfreepages_list(freelist);
+}
+
+static void freevma(struct vma *vma, int free_phy_page) {
+    vma_unmap_range(vma, vma->vm_start, vma->vm_end, free_phy_page);
+}
+
+#define MAP_BATCH (64)
+
+// Map [start, end) of vma to zero-filled physical pages, allocated in batches of MAP_BATCH.
+// PTEs in the range must be invalid.
+// On failure, the pages mapped so far are left to the caller to unmap.
+static int vma_map_zeroed(struct vma *vma, uint64 start, uint64 end) {
+    struct mm *mm = vma->owner;
+    void *__pa pages[MAP_BATCH];
+    pte_t *pte;
+
+    // fail early and cheaply, instead of rolling back a half-mapped range.
+    if (kpgmgr_reserve((end - start) / PGSIZE) < 0)
+        return -ENOMEM;
+
+    uint64 va = start;
+    while (va < end) {
+        int n = MIN((end - va) / PGSIZE, MAP_BATCH);
+        if (kallocpages_bulk_zeroed(n, pages) < 0) {
+            errorf("kallocpages_bulk");
+            return -ENOMEM;
+        }
+        for (int i = 0; i < n; i++, va += PGSIZE) {
+            int ret = 0;
+            if ((pte = walk(mm, va, 1)) == 0) {
+                errorf("pte invalid, va = %p", va);
+                ret = -ENOMEM;
+            } else if (*pte & PTE_V) {
+                errorf("remap %p", va);
+                ret = -EINVAL;
+            }
+            if (ret < 0) {
+                // give back the pages not mapped yet.
+                struct linklist *freelist = NULL;
+                for (; i < n; i++) kpagelist_add(&freelist, pages[i]);
+                kfreepages_list(freelist);
+                return ret;
+            }
+            struct page *pg = pa_to_page((uint64)pages[i]);
+            pg->type        = PAGE_USER;
+            pg->mapcount    = 1;
+            *pte            = PA2PTE(pages[i]) | vma->pte_flags | PTE_V;
+            mm->rss++;
+        }
+    }
+    sfence_vma();
+    return 0;
 }
 
 void mm_free_vmas(struct mm *mm) {
@@ -250,7 +317,7 @@ static int vma_check_overlap(struct mm *mm, uint64 start, uint64 end, struct vma
 /**
  * @brief Map virtual address defined in @vma.
  * Addresses must be aligned to PGSIZE.
- * Physical pages are allocated automatically.
+ * Physical pages are allocated automatically, and filled with zeros.
  * If allocation fails, the already-mapped PAs are freed. Then the vma is freed.
  * Caller should then use walkaddr to resolve the mapped PA, and do initialization.
  *
@@ -275,32 +342,10 @@ int mm_mappages(struct vma *vma) {
     tracef("mappages: [%p, %p)", vma->vm_start, vma->vm_end);
 
     struct mm *mm = vma->owner;
-    uint64 va;
-    void *pa;
-    pte_t *pte;
-    int ret = 0;
+    int ret;
 
-    for (va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
-        if ((pte = walk(mm, va, 1)) == 0) {
-            errorf("pte invalid, va = %p", va);
-            ret = -ENOMEM;
-            goto bad;
-        }
-        if (*pte & PTE_V) {
-            errorf("remap %p", va);
-            ret = -EINVAL;
-            goto bad;
-        }
-        pa = kallocpage();
-        if (!pa) {
-            errorf("kallocpage");
-            ret = -ENOMEM;
-            goto bad;
-        }
-        // memset((void *)PA_TO_KVA(pa), 0, PGSIZE);
-        *pte = PA2PTE(pa) | vma->pte_flags | PTE_V;
-    }
-    sfence_vma();
+    if ((ret = vma_map_zeroed(vma, vma->vm_start, vma->vm_end)) < 0)
+        goto bad;
 
     vma->next = mm->vma;
     mm->vma   = vma;
@@ -314,12 +359,11 @@ bad:
 }
 
 /**
- * Assignment 3 CoW: Modify this method:
- * 
  * @brief Map virtual address defined in @vma, but do CoW based on oldvma.
  * Addresses must be aligned to PGSIZE.
- * Physical pages are allocated automatically.
- * If allocation fails, the already-mapped PAs are freed. Then the vma is freed.
+ * Physical pages are shared with oldvma: writable pages become read-only PG_COW pages in both mms,
+ *  and are copied on the first store (see mm_cow_fault).
+ * If mapping fails, the already-mapped PAs are released. Then the vma is freed.
  * Caller should then use walkaddr to resolve the mapped PA, and do initialization.
  *
  * @param vma
@@ -337,6 +381,7 @@ int mm_mappages_cow(struct vma *vma, struct vma* oldvma) {
     assert(oldvma->vm_start == oldvma->vm_start && oldvma->vm_end == oldvma->vm_end && oldvma->pte_flags == vma->pte_flags);
 
     assert(holding(&vma->owner->lock));
+    assert(holding(&oldvma->owner->lock));
 
     if (vma_check_overlap(vma->owner, vma->vm_start, vma->vm_end, vma)) {
         errorf("overlap: [%p, %p)", vma->vm_start, vma->vm_end);
@@ -348,13 +393,10 @@ int mm_mappages_cow(struct vma *vma, struct vma* oldvma) {
     struct mm *mm = vma->owner;
     struct mm *oldmm = oldvma->owner;
     uint64 va;
-    void *pa;
     pte_t *pte;
     int ret = 0;
 
     for (va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
-        // Assignment 3: CoW: TODO:
-        // checkpoint 1 start
         if ((pte = walk(mm, va, 1)) == 0) {
             errorf("[C1] pte invalid, va = %p", va);
             ret = -ENOMEM;
@@ -382,11 +424,16 @@ int mm_mappages_cow(struct vma *vma, struct vma* oldvma) {
             ret = -ENOMEM;
             goto bad;
         }
-        // memset((void *)PA_TO_KVA(pa), 0, PGSIZE);
-        *pte = PA2PTE(pa) | vma->pte_flags | PTE_V;
-        // checkpoint 1 end
-        // ret = -EINVAL;
-        // goto bad;
+        struct page *pg = pa_to_page(pa);
+        if (*oldpte & (PTE_W | PTE_A3_COW)) {
+            // the old mapping loses its write permission, the new one never gets it.
+            *oldpte = (*oldpte & ~PTE_W) | PTE_A3_COW;
+            __sync_fetch_and_or(&pg->flags, PG_COW);
+        }
+        page_refcnt_increase(pa);
+        __sync_add_and_fetch(&pg->mapcount, 1);
+        *pte = PA2PTE(pa) | PTE_FLAGS(*oldpte);
+        mm->rss++;
     }
     sfence_vma();
 
@@ -411,62 +458,40 @@ int mm_remap(struct vma *vma, uint64 start, uint64 end, uint64 pte_flags) {
     assert((pte_flags & PTE_R) || (pte_flags & PTE_W) || (pte_flags & PTE_X));
     debugf("remap: [%p, %p), flags = %p", start, end, pte_flags);
 
-    // Assignment 3 CoW: In this assignment, we make the following *additional* assumptions to sbrk and mm_remap:
-    //  1. sbrk only increases the size of the heap, never decrease
-    //  2. vma->flags is never changed, heap is always RW without X.
-    if (start != vma->vm_start || end < vma->vm_end || pte_flags != vma->pte_flags)
-        panic("Assignment 3 CoW: Should never happen in this assignment.");
+    // sbrk only moves the end of the heap, and the heap is always RW without X.
+    if (start != vma->vm_start || pte_flags != vma->pte_flags) {
+        errorf("remap: only the end of a vma can be moved");
+        return -EINVAL;
+    }
 
-    pte_t *pte;
+    int ret;
     struct mm *mm = vma->owner;
     assert(holding(&mm->lock));
 
+    if (end < vma->vm_end) {
+        // shrink: give the pages back at once.
+        vma_unmap_range(vma, end, vma->vm_end, true);
+        vma->vm_end = end;
+        return 0;
+    }
+
     if (vma_check_overlap(mm, start, end, vma)) {
         errorf("overlap: [%p, %p)", start, end);
         return -EINVAL;
     }
 
-    const uint64 iterstart = MIN(start, vma->vm_start);
-    const uint64 iterend   = MAX(end, vma->vm_end);
-
-    // first, consider all cases requiring new physical page.
-    for (uint64 va = iterstart; va < iterend; va += PGSIZE) {
-        if (va < start || va >= end) {
-            // mapping to be removed.
-            // however, we do not handle them now.
-        } else {
-            // mapping to be preseved or created.
-            pte = walk(mm, va, 1);
-            if (!pte) {
-                errorf("remap: walk failed, va = %p", va);
-                goto err;
-            }
-            if (*pte & PTE_V) {
-                // mapping exists, update flags.
-                uint64 pte_woflags = *pte & ~PTE_RWX;
-                *pte               = pte_woflags | pte_flags;
-            } else {
-                // mapping does not exist, create it.
-                void *pa = kallocpage();
-                if (!pa) {
-                    errorf("kallocpage, va = %p", va);
-                    goto err;
-                }
-                *pte = PA2PTE(pa) | pte_flags | PTE_V;
-            }
-        }
+    // [vm_start, vm_end) is already mapped with the same flags.
+    //  map fresh zero-filled pages for [vm_end, end), or roll them back all together.
+    if ((ret = vma_map_zeroed(vma, vma->vm_end, end)) < 0) {
+        errorf("remap: [%p, %p) failed: %d", vma->vm_end, end, ret);
+        vma_unmap_range(vma, vma->vm_end, end, true);
+        return ret;
     }
 
-    // Assignment 3 CoW: we never shrink the heap.
-
     vma->vm_start  = start;
     vma->vm_end    = end;
     vma->pte_flags = pte_flags;
     return 0;
-err:
-    // Assignment 3 CoW: To simplify the implementation, we do not handle the error case:
-    panic("Assignment 3 CoW: Should never happen in this assignment.");
-    return -ENOMEM;
 }
 
 // Map a physical page to a virtual address.
@@ -511,26 +536,17 @@ int mm_copy(struct mm *old, struct mm *new) {
     while (vma) {
         tracef("fork: mapping [%p, %p)", vma->vm_start, vma->vm_end);
         struct vma *new_vma = mm_create_vma(new);
+        if (new_vma == NULL)
+            goto err;
         new_vma->vm_start   = vma->vm_start;
         new_vma->vm_end     = vma->vm_end;
         new_vma->pte_flags  = vma->pte_flags;
-        // checkpoint 1 start
         if (mm_mappages_cow(new_vma, vma)) {
+            // when failed, new_vma is not inserted into mm->vma list,
+            //  and it is freed by mm_mappages_cow.
             errorf("[C1] mm_mappages_cow failed");
             goto err;
         }
-        // checkpoint 1 end
-        // if (mm_mappages(new_vma)) {
-        //     warnf("mm_mappages failed");
-        //     // when failed, new_vma is not inserted into mm->vma list.
-        //     // , and it is freed by mm_mappages.
-        //     goto err;
-        // }
-        for (uint64 va = vma->vm_start; va < vma->vm_end; va += PGSIZE) {
-            void *__kva pa_old = (void *)PA_TO_KVA(walkaddr(old, va));
-            void *__kva pa_new = (void *)PA_TO_KVA(walkaddr(new, va));
-            memmove(pa_new, pa_old, PGSIZE);
-        }
         vma = vma->next;
     }
 
@@ -540,6 +556,42 @@ err:
     return -ENOMEM;
 }
 
+// Resolve a store to the CoW page at va: give mm a private, writable copy of the page,
+//  or take the page back if no one else shares it anymore.
+// Return 0 on success, -EINVAL if va is not a CoW page, -ENOMEM if out of memory.
+int mm_cow_fault(struct mm *mm, uint64 va) {
+    assert(holding(&mm->lock));
+
+    pte_t *pte = walk(mm, PGROUNDDOWN(va), 0);
+    if (pte == NULL || !(*pte & PTE_V) || !(*pte & PTE_U) || !(*pte & PTE_A3_COW))
+        return -EINVAL;
+
+    uint64 __pa pa   = PTE2PA(*pte);
+    struct page *pg  = pa_to_page(pa);
+    uint64 pte_flags = (PTE_FLAGS(*pte) & ~PTE_A3_COW) | PTE_W | PTE_A | PTE_D;
+
+    // we hold a reference and mm->lock: if we are the last sharer, no one can share it again meanwhile.
+    if (pg->refcnt == 1) {
+        __sync_fetch_and_and(&pg->flags, ~PG_COW);
+        *pte = PA2PTE(pa) | pte_flags;
+    } else {
+        void *__pa newpa = kallocpage();
+        if (newpa == NULL)
+            return -ENOMEM;
+        memmove((void *)PA_TO_KVA(newpa), (void *)PA_TO_KVA(pa), PGSIZE);
+        struct page *newpg = pa_to_page((uint64)newpa);
+        newpg->type        = PAGE_USER;
+        newpg->mapcount    = 1;
+        *pte               = PA2PTE(newpa) | pte_flags;
+
+        __sync_sub_and_fetch(&pg->mapcount, 1);
+        if (page_refcnt_decrease(pa) == 0)
+            kfreepage((void *)pa);
+    }
+    sfence_vma();
+    return 0;
+}
+
 struct vma *mm_find_vma(struct mm *mm, uint64 va) {
     assert(holding(&mm->lock));
 
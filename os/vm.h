@@ -11,8 +11,8 @@
 
 // Assignment 3 CoW: use PTE bits [9, 8] RSW to represent CoW PTE.
 #define PTE_A3_COW (1L << 8)  // CoW
-int8 page_refcnt_increase(uint64 pa);
-int8 page_refcnt_decrease(uint64 pa);
+int page_refcnt_increase(uint64 pa);
+int page_refcnt_decrease(uint64 pa);
 
 // These two macros are used to convert between kernel virtual address and physical address,
 //  BUT ONLY FOR symbols defined in kernel image.
@@ -48,11 +48,14 @@ struct mm {
     pagetable_t __kva pgt;
     struct vma* vma;
     int refcnt;
+    int64 rss;  // user pages mapped in vmas, including shared ones
 };
 
 // kvm.c
 void kvm_init();
 void kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm);
+void kvmreserve(pagetable_t kpgtbl, uint64 va, uint64 sz);
+void kvmunmap(pagetable_t kpgtbl, uint64 va, uint64 sz);
 
 // vm.c
 void uvm_init();
@@ -70,6 +73,7 @@ int mm_mappages(struct vma* vma);
 int mm_remap(struct vma *vma, uint64 start, uint64 end, uint64 pte_flags);
 int mm_mappageat(struct mm *mm, uint64 va, uint64 __pa pa, uint64 flags);
 int mm_copy(struct mm* old, struct mm* new);
+int mm_cow_fault(struct mm* mm, uint64 va);
 struct vma* mm_find_vma(struct mm* mm, uint64 va);
 
 // uaccess.c
@@ -15,12 +15,36 @@ int getppid();
 
 int sleep(int ticks);
 void yield();
+// run pid now instead of the caller, if it is runnable on this cpu; return < 0 otherwise.
+int yield_to(int pid);
+// 0 is the highest priority; pid 0 is the caller.
+int setpriority(int pid, int prio);
+// bit i of mask is cpu i; pid 0 is the caller.
+int sched_setaffinity(int pid, uint64 mask);
+int64 sched_getaffinity(int pid);
+
+// times in microseconds.
+struct schedstat {
+    uint64 run_time;        // time running on a cpu
+    uint64 wait_time;       // time waiting in a run queue
+    uint64 nr_runs;         // times switched to
+    uint64 nr_voluntary;    // switches by sleep() or yield()
+    uint64 nr_involuntary;  // switches by preemption
+};
+// pid 0 is the caller.
+int schedstat(int pid, struct schedstat *st);
 
 void *sbrk(int increment);
 
 int read(int fd, void *buf, int count);
 int write(int fd, void *buf, int count);
 
+typedef struct {
+    uint64 sec;   // seconds since boot
+    uint64 usec;  // microseconds
+} TimeVal;
+int gettimeofday(TimeVal *ts, int tz);
+
 int ktest(int type, void * arg, uint64 len);
 
 #endif // __SYSCALL_H
@@ -24,6 +24,11 @@ entry("getpid");
 entry("getppid");
 entry("sleep");
 entry("yield");
+entry("yield_to");
+entry("setpriority");
+entry("sched_setaffinity");
+entry("sched_getaffinity");
+entry("schedstat");
 entry("sbrk");
 entry("mmap");
 entry("read");
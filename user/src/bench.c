@@ -0,0 +1,271 @@
+#include "../../os/ktest/ktest.h"
+#include "../lib/user.h"
+
+// Micro-benchmarks for the kernel, run as `bench [name]`.
+// Each benchmark prints the average latency of one operation, in microseconds.
+// The scheduler statistics of the kernel are printed at the end, including the wakeup-to-run latency.
+
+static uint64 now_us() {
+    TimeVal t;
+    gettimeofday(&t, 0);
+    return t.sec * 1000000 + t.usec;
+}
+
+// fork a child which exits at once, and wait for it.
+void fork_wait(char *s) {
+    const int n = 500;
+    int xstatus;
+
+    uint64 t0 = now_us();
+    for (int i = 0; i < n; i++) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
+            exit(0);
+        assert(wait(pid, &xstatus) == pid);
+    }
+    uint64 t1 = now_us();
+    printf("%s: %d us per fork+exit+wait\n", s, (int)((t1 - t0) / n));
+}
+
+// fork_wait with 500 processes alive: wait() and exit() should cost as much as with a few.
+void fork_wait_crowded(char *s) {
+    const int n = 500, ncrowd = 496;  // with init, sh, bench and the child: 500
+    int pids[ncrowd], xstatus;
+
+    for (int i = 0; i < ncrowd; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            sleep(1000000);
+            exit(0);
+        }
+    }
+
+    uint64 t0 = now_us();
+    for (int i = 0; i < n; i++) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0)
+            exit(0);
+        assert(wait(pid, &xstatus) == pid);
+    }
+    uint64 t1 = now_us();
+
+    for (int i = 0; i < ncrowd; i++) {
+        kill(pids[i]);
+        assert(wait(pids[i], &xstatus) == pids[i]);
+    }
+    printf("%s: %d us per fork+exit+wait\n", s, (int)((t1 - t0) / n));
+}
+
+// fork a child which execs `bench -` (exits at once), and wait for it.
+void fork_exec_wait(char *s) {
+    const int n = 200;
+    char *argv[] = {"bench", "-", NULL};
+    int xstatus;
+
+    uint64 t0 = now_us();
+    for (int i = 0; i < n; i++) {
+        int pid = fork();
+        assert(pid >= 0);
+        if (pid == 0) {
+            exec(argv[0], argv);
+            exit(1);
+        }
+        assert(wait(pid, &xstatus) == pid);
+        assert(xstatus == 0);
+    }
+    uint64 t1 = now_us();
+    printf("%s: %d us per fork+exec+exit+wait\n", s, (int)((t1 - t0) / n));
+}
+
+// sleep for one tick, while CPU-bound children keep all cpus busy.
+// The sleeper should get the cpu back as soon as it wakes up, not after the hogs' time slices.
+void sleep_under_load(char *s) {
+    const int n = 50, nhogs = 4;
+    int pids[nhogs], xstatus;
+
+    for (int i = 0; i < nhogs; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0)
+            for (;;);
+    }
+
+    uint64 t0 = now_us();
+    for (int i = 0; i < n; i++) sleep(1);
+    uint64 t1 = now_us();
+
+    struct schedstat st;
+    assert(schedstat(0, &st) == 0);
+    printf("%s: sleeper waited %d us in run queues over %d runs\n", s, (int)st.wait_time, (int)st.nr_runs);
+    assert(schedstat(pids[0], &st) == 0);
+    printf("%s: hog ran %d us, waited %d us, %d preemptions\n", s, (int)st.run_time, (int)st.wait_time, (int)st.nr_involuntary);
+
+    for (int i = 0; i < nhogs; i++) {
+        kill(pids[i]);
+        assert(wait(pids[i], &xstatus) == pids[i]);
+    }
+    printf("%s: %d us per sleep(1)\n", s, (int)((t1 - t0) / n));
+}
+
+// two processes pinned to cpu 0 yield to each other: each yield is one context switch.
+void yield_pingpong(char *s) {
+    const int n = 10000;
+    int64 old = sched_getaffinity(0);
+    int xstatus;
+
+    assert(sched_setaffinity(0, 1) == 0);
+    uint64 t0 = now_us();
+    int pid = fork();
+    assert(pid >= 0);
+    for (int i = 0; i < n; i++) yield();
+    if (pid == 0)
+        exit(0);
+    assert(wait(pid, &xstatus) == pid);
+    uint64 t1 = now_us();
+    assert(sched_setaffinity(0, old) == 0);
+
+    printf("%s: %d ns per switch\n", s, (int)((t1 - t0) * 1000 / (2 * n)));
+}
+
+// a producer/consumer pair hands the cpu back and forth, with two CPU-bound hogs on the same cpu:
+//  yield() lets the hogs run in between, yield_to() switches to the peer at once.
+static void handoff(char *s, int directed) {
+    const int n = 200, nhogs = 2;
+    int64 old = sched_getaffinity(0);
+    int pids[nhogs], xstatus;
+
+    assert(sched_setaffinity(0, 1) == 0);
+    for (int i = 0; i < nhogs; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0)
+            for (;;);
+    }
+
+    uint64 t0 = now_us();
+    int parent = getpid();
+    int pid    = fork();
+    assert(pid >= 0);
+    int peer = pid == 0 ? parent : pid;
+    for (int i = 0; i < n; i++) {
+        if (!directed || yield_to(peer) < 0)
+            yield();
+    }
+    if (pid == 0)
+        exit(0);
+    assert(wait(pid, &xstatus) == pid);
+    uint64 t1 = now_us();
+
+    for (int i = 0; i < nhogs; i++) {
+        kill(pids[i]);
+        assert(wait(pids[i], &xstatus) == pids[i]);
+    }
+    assert(sched_setaffinity(0, old) == 0);
+    printf("%s: %d us per handoff\n", s, (int)((t1 - t0) / (2 * n)));
+}
+
+void handoff_yield(char *s) {
+    handoff(s, 0);
+}
+
+void handoff_yield_to(char *s) {
+    handoff(s, 1);
+}
+
+// the wakeup of a timer tick with hundreds of processes in sleep(), none of them due,
+//  through the deadline-sorted wait queue and through the scan of the whole pool it replaced.
+static void wakeup_cost(char *s, int scan) {
+    const int n = 200, nsleepers = 300;
+    int pids[nsleepers], xstatus;
+
+    for (int i = 0; i < nsleepers; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            sleep(1000000);
+            exit(0);
+        }
+    }
+    sleep(10);
+
+    int ns = ktest(KTEST_WAKEUP, (void *)(uint64)n, scan);
+
+    for (int i = 0; i < nsleepers; i++) {
+        kill(pids[i]);
+        assert(wait(pids[i], &xstatus) == pids[i]);
+    }
+    printf("%s: %d ns per wakeup with %d sleepers\n", s, ns / n, nsleepers);
+}
+
+void wakeup_waitq(char *s) {
+    wakeup_cost(s, 0);
+}
+
+void wakeup_scan(char *s) {
+    wakeup_cost(s, 1);
+}
+
+// push and pop on a kernel queue from 4 processes at once, with the lock-free queue or the old spinlock one.
+static void queue_throughput(char *s, int locked) {
+    const int n = 20000, nprocs = 4, ops = n * 8 * 2;
+    int pids[nprocs], xstatus;
+
+    ktest(KTEST_QUEUE_INIT, (void *)(uint64)locked, 0);
+    uint64 t0 = now_us();
+    for (int i = 0; i < nprocs; i++) {
+        pids[i] = fork();
+        assert(pids[i] >= 0);
+        if (pids[i] == 0) {
+            ktest(KTEST_QUEUE_STRESS, (void *)(uint64)n, 0);
+            exit(0);
+        }
+    }
+    for (int i = 0; i < nprocs; i++) assert(wait(pids[i], &xstatus) == pids[i]);
+    uint64 t1 = now_us();
+    assert(ktest(KTEST_QUEUE_CHECK, 0, 0) == 0);
+    printf("%s: %d ops in %d us\n", s, ops * nprocs, (int)(t1 - t0));
+}
+
+void queue_lockfree(char *s) {
+    queue_throughput(s, 0);
+}
+
+void queue_spinlock(char *s) {
+    queue_throughput(s, 1);
+}
+
+struct test {
+    void (*f)(char *);
+    char *s;
+} benches[] = {
+    {fork_wait,         "fork_wait"        },
+    {fork_wait_crowded, "fork_wait_crowded"},
+    {fork_exec_wait,    "fork_exec_wait"   },
+    {sleep_under_load,  "sleep_under_load" },
+    {yield_pingpong,    "yield_pingpong"   },
+    {handoff_yield,     "handoff_yield"    },
+    {handoff_yield_to,  "handoff_yield_to" },
+    {wakeup_waitq,      "wakeup_waitq"     },
+    {wakeup_scan,       "wakeup_scan"      },
+    {queue_lockfree,    "queue_lockfree"   },
+    {queue_spinlock,    "queue_spinlock"   },
+    {NULL,              NULL               },
+};
+
+int main(int argc, char *argv[]) {
+    // the target of fork_exec_wait.
+    if (argc > 1 && strcmp(argv[1], "-") == 0)
+        return 0;
+
+    char *whichone = argc > 1 ? argv[1] : NULL;
+    printf("=== BENCHMARKS ===\n");
+    for (struct test *t = benches; t->s != 0; t++) {
+        if (whichone == NULL || strcmp(t->s, whichone) == 0)
+            t->f(t->s);
+    }
+    ktest(KTEST_PRINT_SCHED, 0, 0);
+    return 0;
+}
@@ -2,7 +2,16 @@
 #include "../../os/riscv.h"
 #include "../lib/user.h"
 
-#define getfreemem() (ktest(KTEST_GET_NRFREEPGS, 0, 0))
+// Free pages once every cpu has given back what it caches: KTEST_RECLAIM only drains the cpu it runs on.
+static int getfreemem() {
+    uint64 mask = sched_getaffinity(0);
+    for (int i = 0; i < 64; i++) {
+        if ((mask & (1ull << i)) && sched_setaffinity(0, 1ull << i) == 0)
+            ktest(KTEST_RECLAIM, 0, 0);
+    }
+    sched_setaffinity(0, mask);
+    return ktest(KTEST_GET_NRFREEPGS, 0, 0);
+}
 
 /**
  * @brief Test whether we really implement CoW.
@@ -313,6 +322,41 @@ int test3(char *name) {
     return 0;
 }
 
+// Test that the pages are really shared, through the page refcounts:
+//  fork copies no heap page, a write copies the page written, and the parent's data stays as it was.
+int test4(char *name) {
+    const int npages = 50;
+    const int stride = PGSIZE / sizeof(int);
+
+    int *const pheap = (int *)sbrk(npages * PGSIZE);
+    assert((uint64)pheap > 0);
+    for (int i = 0; i < npages; i++) pheap[i * stride] = i;
+    printf(" -> %s - allocate heap: %d pages\n", name, npages);
+
+    int before = getfreemem();
+    int status;
+    int pid = fork();
+    assert_str(pid >= 0, "fork should not fail here");
+
+    if (pid == 0) {
+        // child
+        int forked = getfreemem();
+        // the child's page table and kernel structures, but no heap page.
+        assert_str(before - forked < npages / 2, "fork should share the heap");
+        for (int i = 0; i < npages; i++) pheap[i * stride] = -i;
+        int written = getfreemem();
+        assert_str(forked - written >= npages, "each page written should be copied");
+        for (int i = 0; i < npages; i++) assert(pheap[i * stride] == -i);
+        exit(0);
+    } else {
+        assert(wait(pid, &status) == pid);
+        assert_str(status == 0, "child should exit with code 0");
+        for (int i = 0; i < npages; i++) assert_str(pheap[i * stride] == i, "the parent's data should be unchanged");
+    }
+    printf(" -> %s - CoW fork, child write, parent unchanged\n", name);
+    return 0;
+}
+
 void runtest(int checkleak, int (*func)(char *), char *funcname, char *name) {
     int nfree = getfreemem();
 
@@ -354,6 +398,8 @@ int main(int argc, char *argv[]) {
         runtest(1, test2, "test2", "checkpoint3");
     } else if (which == 4) {
         runtest(1, test3, "test3", "checkpoint4");
+    } else if (which == 5) {
+        runtest(1, test4, "test4", "checkpoint5");
     } else {
         printf("Invalid checkpoint: %d\n", which);
         return 1;
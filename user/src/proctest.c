@@ -2,7 +2,16 @@
 #include "../../os/riscv.h"
 #include "../lib/user.h"
 
-#define getfreemem() (ktest(KTEST_GET_NRFREEPGS, 0, 0))
+// Free pages once every cpu has given back what it caches: KTEST_RECLAIM only drains the cpu it runs on.
+static int getfreemem() {
+    uint64 mask = sched_getaffinity(0);
+    for (int i = 0; i < 64; i++) {
+        if ((mask & (1ull << i)) && sched_setaffinity(0, 1ull << i) == 0)
+            ktest(KTEST_RECLAIM, 0, 0);
+    }
+    sched_setaffinity(0, mask);
+    return ktest(KTEST_GET_NRFREEPGS, 0, 0);
+}
 
 // regression test. test whether exec() leaks memory if one of the
 // arguments is invalid. the test passes if the kernel doesn't panic.
@@ -135,6 +144,66 @@ void exitwait(char *s) {
     }
 }
 
+// cpu affinity is inherited across fork, and an empty mask is rejected.
+void affinity(char *s) {
+    int64 old = sched_getaffinity(0);
+    if (old <= 0) {
+        printf("%s: sched_getaffinity failed\n", s);
+        exit(1);
+    }
+    // cpu 0 is always online.
+    if (sched_setaffinity(0, 1) != 0 || sched_getaffinity(0) != 1) {
+        printf("%s: sched_setaffinity failed\n", s);
+        exit(1);
+    }
+    if (sched_setaffinity(0, 0) >= 0) {
+        printf("%s: empty mask accepted\n", s);
+        exit(1);
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+        printf("%s: fork failed\n", s);
+        exit(1);
+    }
+    if (pid == 0)
+        exit(sched_getaffinity(0) == 1 ? 0 : 1);
+
+    int xstate;
+    if (wait(pid, &xstate) != pid || xstate != 0) {
+        printf("%s: child did not inherit the affinity\n", s);
+        exit(1);
+    }
+    if (sched_setaffinity(0, old) != 0) {
+        printf("%s: restore affinity failed\n", s);
+        exit(1);
+    }
+}
+
+// concurrent pushes and pops on the kernel's lock-free queue, from all harts under runsmp.
+void queuestress(char *s) {
+    enum { N = 4 };
+    int pids[N], xstate;
+
+    ktest(KTEST_QUEUE_INIT, 0, 0);
+    for (int i = 0; i < N; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            printf("%s: fork failed\n", s);
+            exit(1);
+        }
+        if (pids[i] == 0) {
+            ktest(KTEST_QUEUE_STRESS, (void *)20000, 0);
+            exit(0);
+        }
+    }
+    for (int i = 0; i < N; i++) wait(pids[i], &xstate);
+    if (ktest(KTEST_QUEUE_CHECK, 0, 0) != 0) {
+        printf("%s: queue lost or duplicated elements\n", s);
+        exit(1);
+    }
+}
+
 // try to find races in the reparenting
 // code that handles a parent exiting
 // when it still has live children.
@@ -365,6 +434,8 @@ struct test {
     {exec_nomem,  "exec_nomem" },
     {killstatus,  "killstatus" },
     {exitwait,    "exitwait"   },
+    {affinity,    "affinity"   },
+    {queuestress, "queuestress"},
     {reparent,    "reparent"   },
     {forkfork,    "forkfork"   },
     {sbrkbasic,   "sbrkbasic"  },
@@ -413,14 +484,14 @@ int runtests(struct test *tests, char *whichone, int continuous) {
 int drivetests(int quick, int continuous, char *whichone) {
     do {
         printf("usertests starting\n");
-        int freepg  = ktest(KTEST_GET_NRFREEPGS, 0, 0);
+        int freepg  = getfreemem();
         int freebuf = ktest(KTEST_GET_NRSTRBUF, 0, 0);
         if (runtests(proctests, whichone, continuous)) {
             if (continuous != 2) {
                 return 1;
             }
         }
-        int freepg1  = ktest(KTEST_GET_NRFREEPGS, 0, 0);
+        int freepg1  = getfreemem();
         int freebuf1 = ktest(KTEST_GET_NRSTRBUF, 0, 0);
         if (freepg1 < freepg || freebuf < freebuf1) {
             printf("FAILED -- lost some free pages %d (out of %d), kstrbuf: %d (out of %d)\n", freepg1, freepg, freebuf1, freebuf);